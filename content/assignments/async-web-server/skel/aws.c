@@ -1,35 +1,103 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/sendfile.h>
 #include <sys/eventfd.h>
+#ifndef AWS_IO_URING
 #include <libaio.h>
+#endif
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "aws.h"
+#include "fd_cache.h"
+#include "response_cache.h"
+#include "metrics.h"
 #include "utils/util.h"
 #include "utils/debug.h"
 #include "utils/sock_util.h"
 #include "utils/w_epoll.h"
+#include "utils/pool.h"
+
+/* Open files of the worker, shared by its connections */
+__thread struct fd_cache *file_cache;
+
+/* Whole replies of small dynamic files of the worker */
+__thread struct response_cache *response_cache;
+
+/* Connections and buffers of the worker, reused */
+static __thread struct pool connection_pool = POOL_INIT(sizeof(struct connection), AWS_POOL_MAX_FREE);
+static __thread struct pool buffer_pool = POOL_INIT(BUFSIZ, AWS_POOL_MAX_FREE);
+
+/* Scratch space of the request being parsed; a worker handles one at a time. */
+static __thread char request_path[BUFSIZ];
+static __thread char request_filename[BUFSIZ];
+
+#ifndef AWS_IO_URING
+
+/*
+ * Every worker thread runs its own event loop on its own listening socket,
+ * epoll instance and AIO context: the state below is per thread and workers
+ * share nothing. The kernel spreads incoming connections over the listening
+ * sockets (SO_REUSEPORT).
+ */
 
 /* server socket file descriptor */
-static int listenfd;
+static __thread int listenfd;
 
 /* epoll file descriptor */
-static int epollfd;
+static __thread int epollfd;
+
+static __thread io_context_t ctx;
+
+/* signaled by the kernel when asynchronous reads complete */
+static __thread int aio_eventfd;
 
-static io_context_t ctx;
+/* connections closed during the current event batch */
+static __thread struct connection *closed_conns;
+
+/*
+ * Connections whose reads found the AIO context full, in the order they
+ * came; they are resumed as reads in flight (aio_inflight) complete.
+ */
+static __thread struct connection *aio_waiters, *aio_waiters_tail;
+static __thread unsigned int aio_inflight;
+
+/*
+ * When accepting ran out of file descriptors or memory, the time to try
+ * again at, 0 otherwise. The listener is edge-triggered: the connections
+ * left in its backlog raise no new event.
+ */
+static __thread uint64_t accept_retry_ns;
+
+/* Reads in flight ahead of the socket for each dynamic file, and their size */
+static __thread unsigned int aio_depth;
+/* Rings of aio_depth reads, and buffers of files larger than BUFSIZ */
+static __thread struct pool read_pool;
+static __thread struct pool chunk_pool;
+
+/* Splice dynamic files larger than a cached reply, through pipes of pipe_size */
+static __thread int splice_files;
+static __thread size_t pipe_size;
+static __thread int free_pipes[AWS_PIPE_MAX_FREE][2];
+static __thread unsigned int num_free_pipes;
+
+#endif /* !AWS_IO_URING */
 
 static int aws_on_path_cb(http_parser *p, const char *buf, size_t len)
 {
@@ -42,89 +110,206 @@ static int aws_on_path_cb(http_parser *p, const char *buf, size_t len)
 	return 0;
 }
 
+/*
+ * Header of a 200 reply with a body of length bytes, and of content_type
+ * unless it is NULL; returns its length, as snprintf()
+ */
+int aws_format_reply_header(char *buf, size_t size, size_t length, int keep_alive,
+			    const char *content_type)
+{
+	return snprintf(buf, size,
+			"HTTP/1.1 200 OK\r\n"
+			"%s%s%s"
+			"Content-Length: %zu\r\n"
+			"Connection: %s\r\n"
+			"\r\n",
+			content_type ? "Content-Type: " : "", content_type ? content_type : "",
+			content_type ? "\r\n" : "",
+			length, keep_alive ? "keep-alive" : "close");
+}
+
 static void prepare_connection_send_reply_header(struct connection *conn)
 {
-	/* TODO: Prepare the connection buffer to send the reply header. */
+	conn->send_len = aws_format_reply_header(conn->header, sizeof(conn->header),
+						 conn->file_size, conn->keep_alive, NULL);
+	conn->send_pos = 0;
+	conn->state = STATE_SENDING_HEADER;
 }
 
 static void prepare_connection_send_404(struct connection *conn)
 {
-	/* TODO: Prepare the connection buffer to send the 404 header. */
+	conn->send_len = snprintf(conn->header, sizeof(conn->header),
+				  "HTTP/1.1 404 Not Found\r\n"
+				  "Content-Length: 0\r\n"
+				  "Connection: %s\r\n"
+				  "\r\n", conn->keep_alive ? "keep-alive" : "close");
+	conn->send_pos = 0;
+	conn->state = STATE_SENDING_404;
 }
 
 static enum resource_type connection_get_resource_type(struct connection *conn)
 {
-	/*
-	 * TODO: Get resource type depending on request path/filename. Filename should
-	 * point to the static or dynamic folder.
-	 */
+	const char *path = conn->request_path;
+	enum resource_type type;
+
+	if (strncmp(path, "/" AWS_REL_STATIC_FOLDER, strlen("/" AWS_REL_STATIC_FOLDER)) == 0)
+		type = RESOURCE_TYPE_STATIC;
+	else if (strncmp(path, "/" AWS_REL_DYNAMIC_FOLDER, strlen("/" AWS_REL_DYNAMIC_FOLDER)) == 0)
+		type = RESOURCE_TYPE_DYNAMIC;
+	else
+		return RESOURCE_TYPE_NONE;
+
+	/* Do not serve anything outside of the document root. */
+	if (strstr(path, "..") != NULL)
+		return RESOURCE_TYPE_NONE;
 
-	return RESOURCE_TYPE_NONE;
+	conn->filename = request_filename;
+	snprintf(conn->filename, BUFSIZ, "%s%s", AWS_DOCUMENT_ROOT, path + 1);
+	return type;
 }
 
 
-struct connection *connection_create(int sockfd)
+char *aws_buffer_get(void)
 {
-	/* TODO: Initialize connection structure on given socket. */
-
-	return NULL;
+	return pool_get(&buffer_pool);
 }
 
-void connection_start_async_io(struct connection *conn)
+void aws_buffer_put(char *buf)
 {
-	/* TODO: Start asynchronous operation (read from file).
-	 * Use io_submit(2) & friends for reading data asynchronously.
-	 */
+	pool_put(&buffer_pool, buf);
 }
 
-
-void connection_remove(struct connection *conn)
+struct connection *connection_create(int sockfd)
 {
-	/* TODO: Remove connection handler. */
+	struct connection *conn = pool_get(&connection_pool);
+
+	if (conn == NULL)
+		return NULL;
+
+	memset(conn, 0, sizeof(*conn));
+	metrics_add(&worker_metrics->connections_opened, 1);
+	conn->state_since = metrics_now_ns;
+	conn->sockfd = sockfd;
+	conn->fd = -1;
+#ifndef AWS_IO_URING
+	conn->pipefd[0] = -1;
+	conn->pipefd[1] = -1;
+#endif
+	conn->state = STATE_INITIAL;
+	conn->metrics_state = STATE_INITIAL;
+
+	return conn;
 }
 
+/* Give the connection and its buffers back to the pools */
+void connection_free(struct connection *conn)
+{
+	if (conn->recv_buffer != NULL)
+		aws_buffer_put(conn->recv_buffer);
+	if (conn->send_buffer != NULL)
+		aws_buffer_put(conn->send_buffer);
+	pool_put(&connection_pool, conn);
+	metrics_add(&worker_metrics->connections_closed, 1);
+}
 
-void handle_new_connection(void)
+void connection_note_state(struct connection *conn)
 {
-	/* TODO: Handle a new connection request on the server socket. */
+	if (conn->state == conn->metrics_state)
+		return;
+
+	metrics_dwell(conn->metrics_state, metrics_now_ns - conn->state_since);
+	conn->metrics_state = conn->state;
+	conn->state_since = metrics_now_ns;
+}
 
-	/* TODO a: Accept new connection. */
+/*
+ * Get a kept-alive connection ready for its next request. Bytes received
+ * after the current request (pipelined requests) are kept.
+ */
+void connection_reset(struct connection *conn)
+{
+	connection_close_file(conn);
 
-	/* TODO b: Set socket to be non-blocking. */
+	conn->recv_len -= conn->request_len;
+	if (conn->recv_len > 0) {
+		memmove(conn->recv_buffer, conn->recv_buffer + conn->request_len,
+			conn->recv_len);
+		conn->recv_buffer[conn->recv_len] = '\0';
+	} else {
+		/* Nothing pipelined: the connection is idle until the next request. */
+		aws_buffer_put(conn->recv_buffer);
+		conn->recv_buffer = NULL;
+	}
 
-	/* TODO c: Instantiate new connection handler. */
+	conn->request_len = 0;
 
-	/* TODO d: Add socket to epoll. */
+	if (conn->send_buffer != NULL) {
+		aws_buffer_put(conn->send_buffer);
+		conn->send_buffer = NULL;
+	}
 
-	/* TODO e: Initialize HTTP_REQUEST parser. */
+	conn->send_len = 0;
+	conn->send_pos = 0;
+	conn->file_size = 0;
+	conn->file_pos = 0;
+	conn->have_path = 0;
+	conn->res_type = RESOURCE_TYPE_NONE;
+	conn->state = STATE_INITIAL;
 }
 
-
-void receive_data(struct connection *conn)
+/* Find the end of the request's headers; requests are expected to have no body. */
+int connection_find_request(struct connection *conn)
 {
-	/* TODO: Receive message on socket.
-	 * Store message in recv_buffer in struct connection.
-	 */
+	char *end;
+
+	if (conn->recv_len == 0)
+		return 0;
+
+	end = memmem(conn->recv_buffer, conn->recv_len, "\r\n\r\n", 4);
+	if (end != NULL) {
+		conn->request_len = end + 4 - conn->recv_buffer;
+		return 1;
+	}
+
+	/* A request too large for the buffer is answered with 404. */
+	if (conn->recv_len == BUFSIZ - 1) {
+		conn->request_len = conn->recv_len;
+		return 1;
+	}
+
+	return 0;
 }
 
 int connection_open_file(struct connection *conn)
 {
-	/* TODO: Open file and update connection fields. */
+	/* Hot files are open already: no open(), fstat() or path lookup. */
+	conn->file = fd_cache_get(file_cache, conn->filename);
+	if (conn->file == NULL)
+		return -1;
 
-	return 0;
+	conn->fd = conn->file->fd;
+	conn->file_size = conn->file->size;
+	conn->file_pos = 0;
+	return conn->fd;
 }
 
-void connection_complete_async_io(struct connection *conn)
+/* Release the requested file; its descriptor may stay open in the cache. */
+void connection_close_file(struct connection *conn)
 {
-	/* TODO: Complete asynchronous operation; operation returns successfully.
-	 * Prepare socket for sending.
-	 */
+	if (conn->response != NULL) {
+		response_put(conn->response);
+		conn->response = NULL;
+	}
+	if (conn->file == NULL)
+		return;
+
+	fd_cache_put(file_cache, conn->file);
+	conn->file = NULL;
+	conn->fd = -1;
 }
 
 int parse_header(struct connection *conn)
 {
-	/* TODO: Parse the HTTP header and extract the file path. */
-
 	/* Use mostly null settings except for on_path callback. */
 	http_parser_settings settings_on_path = {
 		.on_message_begin = 0,
@@ -138,99 +323,955 @@ int parse_header(struct connection *conn)
 		.on_headers_complete = 0,
 		.on_message_complete = 0
 	};
+	http_parser request_parser;
+	size_t parsed;
+
+	http_parser_init(&request_parser, HTTP_REQUEST);
+	request_parser.data = conn;
+	conn->request_path = request_path;
+	conn->keep_alive = 0;
 
+	parsed = http_parser_execute(&request_parser, &settings_on_path,
+				     conn->recv_buffer, conn->request_len);
+	if (parsed != conn->request_len || !conn->have_path)
+		return -1;
+
+	/* HTTP/1.1 unless "Connection: close", HTTP/1.0 with "Connection: keep-alive" */
+	conn->keep_alive = http_should_keep_alive(&request_parser);
 	return 0;
 }
 
+/* Set up the state of the calling worker thread common to both backends */
+void aws_worker_init(const struct aws_worker *worker)
+{
+	cpu_set_t set;
+	int rc;
+
+	rc = metrics_init();
+	DIE(rc < 0, "metrics_init");
+
+	file_cache = fd_cache_create(worker->fd_cache_size);
+	DIE(file_cache == NULL, "fd_cache_create");
+
+	response_cache = response_cache_create(file_cache, worker->response_cache_bytes,
+					       worker->response_cache_entries,
+					       AWS_RESPONSE_CACHE_MAX_BODY);
+	DIE(response_cache == NULL, "response_cache_create");
+
+	if (worker->cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(worker->cpu, &set);
+	rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0)
+		dlog(LOG_WARNING, "Worker %u can't be pinned to CPU %d\n",
+		     worker->id, worker->cpu);
+}
+
+/* Parse the received request and prepare its reply: a file or 404 */
+void handle_request(struct connection *conn)
+{
+	conn->res_type = RESOURCE_TYPE_NONE;
+	if (parse_header(conn) == 0) {
+		if (strcmp(conn->request_path, AWS_METRICS_PATH) == 0)
+			conn->response = metrics_response();
+		else
+			conn->res_type = connection_get_resource_type(conn);
+	}
+
+	if (conn->response == NULL &&
+	    (conn->res_type == RESOURCE_TYPE_NONE || connection_open_file(conn) < 0)) {
+		metrics_add(&worker_metrics->requests[METRICS_CODE_404], 1);
+		prepare_connection_send_404(conn);
+		return;
+	}
+	metrics_add(&worker_metrics->requests[METRICS_CODE_200], 1);
+
+	/* The whole reply may be cached: send it from memory, without AIO. */
+	if (conn->res_type == RESOURCE_TYPE_DYNAMIC)
+		conn->response = response_cache_get(response_cache, conn->file);
+	if (conn->response != NULL) {
+		conn->send_len = conn->response->header_len[conn->keep_alive != 0] +
+				 conn->response->body_len;
+		conn->send_pos = 0;
+		conn->state = STATE_SENDING_DATA;
+		return;
+	}
+
+	prepare_connection_send_reply_header(conn);
+}
+
+#ifndef AWS_IO_URING
+
+/* Small files are read in one BUFSIZ buffer, larger ones in chunks. */
+static struct pool *connection_read_pool(struct connection *conn)
+{
+	return conn->file_size <= BUFSIZ ? &buffer_pool : &chunk_pool;
+}
+
+/* Give the ring of reads and its buffers back; no read may be in flight. */
+static void connection_put_reads(struct connection *conn)
+{
+	struct pool *pool = connection_read_pool(conn);
+	unsigned int i;
+
+	if (conn->reads == NULL)
+		return;
+
+	for (i = 0; i < aio_depth; i++)
+		if (conn->reads[i].buf != NULL)
+			pool_put(pool, conn->reads[i].buf);
+	pool_put(&read_pool, conn->reads);
+
+	conn->reads = NULL;
+	conn->read_head = 0;
+	conn->read_tail = 0;
+	conn->read_pos = 0;
+	conn->send_buffer = NULL;
+}
+
+/* Wait for reads of other connections to complete and free the AIO context. */
+static void connection_wait_aio(struct connection *conn)
+{
+	conn->aio_waiting = 1;
+	conn->next_aio_waiting = NULL;
+	if (aio_waiters_tail != NULL)
+		aio_waiters_tail->next_aio_waiting = conn;
+	else
+		aio_waiters = conn;
+	aio_waiters_tail = conn;
+	conn->state = STATE_ASYNC_ONGOING;
+}
+
+/*
+ * Keep up to aio_depth reads of the next chunks of the file in flight, all
+ * submitted at once, so that the file is read while earlier chunks are
+ * sent. Reads the AIO context has no room for are submitted later: once a
+ * chunk is sent, or, if none is in flight, once reads of other connections
+ * complete. Only other failures leaving the ring empty are errors.
+ */
+void connection_start_async_io(struct connection *conn)
+{
+	struct pool *pool = connection_read_pool(conn);
+	struct iocb *piocb[AWS_AIO_MAX_DEPTH];
+	int n = 0, rc, err = 0;
+
+	if (conn->reads == NULL) {
+		conn->reads = pool_get(&read_pool);
+		if (conn->reads == NULL) {
+			conn->state = STATE_CONNECTION_CLOSED;
+			return;
+		}
+		memset(conn->reads, 0, read_pool.size);
+		conn->read_pos = conn->file_pos;
+	}
+
+	while (conn->read_tail - conn->read_head < aio_depth &&
+	       conn->read_pos < conn->file_size) {
+		struct aio_read *rd = &conn->reads[conn->read_tail % aio_depth];
+		size_t len = conn->file_size - conn->read_pos;
+
+		if (len > pool->size)
+			len = pool->size;
+		if (rd->buf == NULL) {
+			rd->buf = pool_get(pool);
+			if (rd->buf == NULL)
+				break;
+		}
+
+		io_prep_pread(&rd->iocb, conn->fd, rd->buf, len, conn->read_pos);
+		io_set_eventfd(&rd->iocb, aio_eventfd);
+		rd->iocb.data = conn;
+		rd->len = len;
+		rd->done = 0;
+		piocb[n++] = &rd->iocb;
+
+		conn->read_tail++;
+		conn->read_pos += len;
+	}
+
+	if (n > 0) {
+		rc = io_submit(ctx, n, piocb);
+		if (rc < 0) {
+			err = rc;
+			if (rc != -EAGAIN)
+				dlog(LOG_ERR, "io_submit failed: %d\n", rc);
+			rc = 0;
+		}
+		/* Take back the reads that were not submitted. */
+		if (rc < n) {
+			conn->read_tail -= n - rc;
+			conn->read_pos = piocb[rc]->u.c.offset;
+		}
+		conn->reads_inflight += rc;
+		aio_inflight += rc;
+	}
+
+	if (conn->read_tail == conn->read_head) {
+		/* A full context frees up as the reads in flight complete. */
+		if (err == -EAGAIN && aio_inflight > 0) {
+			connection_wait_aio(conn);
+			return;
+		}
+		conn->state = STATE_CONNECTION_CLOSED;
+		return;
+	}
+	conn->state = STATE_ASYNC_ONGOING;
+}
+
+
+/* Free the connection after the current event batch. */
+static void connection_defer_free(struct connection *conn)
+{
+	connection_put_reads(conn);
+	conn->next_closed = closed_conns;
+	closed_conns = conn;
+}
+/* Dynamic files too large for the reply cache are spliced, with -z. */
+static int connection_use_splice(struct connection *conn)
+{
+	return splice_files && conn->file_size > AWS_RESPONSE_CACHE_MAX_BODY;
+}
+
+static int connection_get_pipe(struct connection *conn)
+{
+	if (num_free_pipes > 0) {
+		num_free_pipes--;
+		conn->pipefd[0] = free_pipes[num_free_pipes][0];
+		conn->pipefd[1] = free_pipes[num_free_pipes][1];
+		return 0;
+	}
+
+	if (pipe2(conn->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		conn->pipefd[0] = -1;
+		conn->pipefd[1] = -1;
+		return -1;
+	}
+	/* Best effort: pipe-max-size may be lower. */
+	fcntl(conn->pipefd[1], F_SETPIPE_SZ, pipe_size);
+	return 0;
+}
+
+/* An empty pipe goes back to the worker's free list, one with data is closed. */
+static void connection_put_pipe(struct connection *conn)
+{
+	if (conn->pipefd[0] < 0)
+		return;
+
+	if (conn->pipe_len == 0 && num_free_pipes < AWS_PIPE_MAX_FREE) {
+		free_pipes[num_free_pipes][0] = conn->pipefd[0];
+		free_pipes[num_free_pipes][1] = conn->pipefd[1];
+		num_free_pipes++;
+	} else {
+		close(conn->pipefd[0]);
+		close(conn->pipefd[1]);
+	}
+
+	conn->pipefd[0] = -1;
+	conn->pipefd[1] = -1;
+	conn->pipe_len = 0;
+}
+
+void connection_remove(struct connection *conn)
+{
+	connection_put_pipe(conn);
+	connection_close_file(conn);
+	/* Closing the socket also removes it from the epoll set. */
+	close(conn->sockfd);
+
+	/*
+	 * Events for it may still be pending in the current batch. Reads still
+	 * in flight fill its buffers: the last one to complete frees it.
+	 */
+	conn->state = STATE_CONNECTION_CLOSED;
+	if (conn->reads_inflight == 0)
+		connection_defer_free(conn);
+}
+
+static void free_closed_connections(void)
+{
+	while (closed_conns != NULL) {
+		struct connection *conn = closed_conns;
+
+		closed_conns = conn->next_closed;
+		connection_free(conn);
+	}
+}
+
+
+void handle_new_connection(void)
+{
+	/* The listener is edge-triggered: accept every pending connection. */
+	while (1) {
+		struct connection *conn;
+		int sockfd;
+		int rc;
+
+		sockfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+		if (sockfd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			/* That connection is gone, the next ones may not be. */
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			ERR("accept4");
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+				accept_retry_ns = metrics_now_ns + AWS_ACCEPT_BACKOFF_MS * 1000000ULL;
+			return;
+		}
+
+		conn = connection_create(sockfd);
+		if (conn == NULL) {
+			ERR("connection_create");
+			close(sockfd);
+			continue;
+		}
+
+		/* Registered once for both directions, never modified. */
+		rc = w_epoll_add_ptr_inout_et(epollfd, sockfd, conn);
+		if (rc < 0) {
+			ERR("w_epoll_add_ptr_inout_et");
+			close(sockfd);
+			connection_free(conn);
+		}
+	}
+}
+
+
+void receive_data(struct connection *conn)
+{
+	if (conn->recv_buffer == NULL) {
+		conn->recv_buffer = aws_buffer_get();
+		if (conn->recv_buffer == NULL) {
+			conn->state = STATE_CONNECTION_CLOSED;
+			return;
+		}
+	}
+
+	/* Requests pipelined behind the previous one may be buffered already. */
+	while (!connection_find_request(conn)) {
+		ssize_t n = recv(conn->sockfd, conn->recv_buffer + conn->recv_len,
+				 BUFSIZ - 1 - conn->recv_len, 0);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				metrics_add(&worker_metrics->eagain[METRICS_OP_RECV], 1);
+				/* Idle connections hold no buffer. */
+				if (conn->recv_len == 0) {
+					aws_buffer_put(conn->recv_buffer);
+					conn->recv_buffer = NULL;
+				}
+				conn->state = STATE_RECEIVING_DATA;
+				return;
+			}
+			if (errno == EINTR)
+				continue;
+			conn->state = STATE_CONNECTION_CLOSED;
+			return;
+		}
+		if (n == 0) {
+			conn->state = STATE_CONNECTION_CLOSED;
+			return;
+		}
+
+		conn->recv_len += n;
+		conn->recv_buffer[conn->recv_len] = '\0';
+	}
+
+	conn->state = STATE_REQUEST_RECEIVED;
+}
+
+/* Send the chunk at the head of the ring, once it is read. */
+void connection_complete_async_io(struct connection *conn)
+{
+	struct aio_read *rd = &conn->reads[conn->read_head % aio_depth];
+
+	if (!rd->done)
+		return;
+
+	/* A failed or short read of a regular file ends the connection. */
+	if (rd->res < 0 || (size_t)rd->res != rd->len) {
+		conn->state = STATE_CONNECTION_CLOSED;
+		return;
+	}
+
+	/* A small file read whole: keep its reply for the next requests. */
+	if (conn->file_pos == 0 && rd->len == conn->file_size)
+		response_cache_add(response_cache, conn->file, rd->buf, rd->len);
+
+	conn->send_buffer = rd->buf;
+	conn->send_len = rd->len;
+	conn->send_pos = 0;
+	conn->file_pos += rd->len;
+	conn->state = STATE_SENDING_DATA;
+}
+
 enum connection_state connection_send_static(struct connection *conn)
 {
-	/* TODO: Send static data using sendfile(2). */
-	/* Return value is the state of the connection at the time this function reaches the end. */
+	while (conn->file_pos < conn->file_size) {
+		off_t offset = conn->file_pos;
+		ssize_t n = sendfile(conn->sockfd, conn->fd, &offset,
+				     conn->file_size - conn->file_pos);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				metrics_add(&worker_metrics->eagain[METRICS_OP_SENDFILE], 1);
+				return STATE_SENDING_DATA;
+			}
+			if (errno == EINTR)
+				continue;
+			return STATE_CONNECTION_CLOSED;
+		}
+		if (n == 0)
+			return STATE_CONNECTION_CLOSED;
+		metrics_add(&worker_metrics->sent_bytes[METRICS_SOURCE_SENDFILE], n);
+		conn->file_pos += n;
+	}
 
-	return STATE_NO_STATE;
+	return STATE_DATA_SENT;
+}
+
+/*
+ * Move a dynamic file to the socket through the connection's pipe, with no
+ * copy to user space: the pipe is filled from the page cache when empty,
+ * then drained into the socket. Unlike the asynchronous reads, filling the
+ * pipe waits for the disk if the file is not cached.
+ */
+static enum connection_state connection_send_splice(struct connection *conn)
+{
+	while (conn->file_pos < conn->file_size || conn->pipe_len > 0) {
+		unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+		ssize_t n;
+
+		if (conn->pipe_len == 0) {
+			loff_t offset = conn->file_pos;
+
+			n = splice(conn->fd, &offset, conn->pipefd[1], NULL,
+				   conn->file_size - conn->file_pos, flags);
+			if (n < 0 && errno == EINTR)
+				continue;
+			/* The pipe is empty: a failure or 0 is the file's. */
+			if (n <= 0)
+				return STATE_CONNECTION_CLOSED;
+			conn->file_pos += n;
+			conn->pipe_len = n;
+		}
+
+		if (conn->file_pos < conn->file_size)
+			flags |= SPLICE_F_MORE;
+		n = splice(conn->pipefd[0], NULL, conn->sockfd, NULL, conn->pipe_len, flags);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				metrics_add(&worker_metrics->eagain[METRICS_OP_SPLICE], 1);
+				return STATE_SENDING_DATA;
+			}
+			if (errno == EINTR)
+				continue;
+			return STATE_CONNECTION_CLOSED;
+		}
+		metrics_add(&worker_metrics->sent_bytes[METRICS_SOURCE_SPLICE], n);
+		conn->pipe_len -= n;
+	}
+
+	return STATE_DATA_SENT;
+}
+
+/* Send a cached reply, header and body in one sendmsg() */
+static int connection_send_response(struct connection *conn)
+{
+	size_t start = conn->send_pos;
+
+	while (conn->send_pos < conn->send_len) {
+		struct iovec iov[2];
+		struct msghdr msg = { .msg_iov = iov };
+		ssize_t n;
+
+		msg.msg_iovlen = response_iov(conn->response, conn->keep_alive,
+					      conn->send_pos, iov);
+		n = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				metrics_add(&worker_metrics->eagain[METRICS_OP_SEND], 1);
+				break;
+			}
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		conn->send_pos += n;
+	}
+
+	metrics_add(&worker_metrics->sent_bytes[METRICS_SOURCE_CACHE], conn->send_pos - start);
+	return conn->send_pos - start;
 }
 
 int connection_send_data(struct connection *conn)
 {
-	/* May be used as a helper function.
-	 * TODO: Send as much data as possible from the connection send buffer.
-	 * Returns the number of bytes sent or -1 if an error occurred
+	/* The header or 404 is inline, file data is in the borrowed send buffer. */
+	const char *buf = conn->state == STATE_SENDING_DATA ? conn->send_buffer : conn->header;
+	size_t start = conn->send_pos;
+	int flags = MSG_NOSIGNAL;
+
+	/*
+	 * More of the reply follows this buffer: don't push a short segment,
+	 * let the header or chunk share packets with what comes next. The
+	 * last send of the reply, without MSG_MORE, pushes everything out.
 	 */
+	if (conn->state == STATE_SENDING_HEADER ? conn->file_size > 0 :
+	    conn->state == STATE_SENDING_DATA && conn->file_pos < conn->file_size)
+		flags |= MSG_MORE;
 
-	return 0;
+	while (conn->send_pos < conn->send_len) {
+		ssize_t n = send(conn->sockfd, buf + conn->send_pos,
+				 conn->send_len - conn->send_pos, flags);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				metrics_add(&worker_metrics->eagain[METRICS_OP_SEND], 1);
+				break;
+			}
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		conn->send_pos += n;
+	}
+
+	metrics_add(&worker_metrics->sent_bytes[conn->state == STATE_SENDING_DATA ?
+			METRICS_SOURCE_ASYNC : METRICS_SOURCE_HEADER], conn->send_pos - start);
+	return conn->send_pos - start;
 }
 
 
 int connection_send_dynamic(struct connection *conn)
 {
-	/* TODO: Read data asynchronously.
-	 * Returns 0 on success and -1 on error.
-	 */
+	/* The chunk at the head is sent: its slot takes the next read. */
+	if (conn->send_buffer != NULL) {
+		conn->send_buffer = NULL;
+		conn->read_head++;
+	}
+
+	if (conn->file_pos >= conn->file_size) {
+		connection_put_reads(conn);
+		conn->state = STATE_DATA_SENT;
+		return 0;
+	}
+
+	connection_start_async_io(conn);
+	if (conn->state != STATE_ASYNC_ONGOING)
+		return -1;
 
+	/* The next chunk may have been read while this one was sent. */
+	connection_complete_async_io(conn);
 	return 0;
 }
 
 
-void handle_input(struct connection *conn)
+/*
+ * Advance the connection's state machine until it has to wait: for the
+ * socket to become readable or writable, or for an asynchronous read.
+ */
+static void connection_run(struct connection *conn)
 {
-	/* TODO: Handle input information: may be a new message or notification of
-	 * completion of an asynchronous I/O operation.
-	 */
+	while (1) {
+		connection_note_state(conn);
+
+		switch (conn->state) {
+		case STATE_INITIAL:
+		case STATE_RECEIVING_DATA:
+			receive_data(conn);
+			if (conn->state == STATE_RECEIVING_DATA)
+				return;
+			break;
+		case STATE_REQUEST_RECEIVED:
+			handle_request(conn);
+			break;
+		case STATE_SENDING_HEADER:
+		case STATE_SENDING_404:
+			if (connection_send_data(conn) < 0) {
+				connection_remove(conn);
+				return;
+			}
+			if (conn->send_pos < conn->send_len)
+				return;
+			conn->state = conn->state == STATE_SENDING_404 ?
+				STATE_404_SENT : STATE_HEADER_SENT;
+			break;
+		case STATE_HEADER_SENT:
+			if (conn->res_type == RESOURCE_TYPE_STATIC)
+				conn->state = STATE_SENDING_DATA;
+			else if (connection_use_splice(conn))
+				conn->state = connection_get_pipe(conn) < 0 ?
+					STATE_CONNECTION_CLOSED : STATE_SENDING_DATA;
+			else if (connection_send_dynamic(conn) < 0)
+				conn->state = STATE_CONNECTION_CLOSED;
+			break;
+		case STATE_SENDING_DATA:
+			if (conn->response != NULL) {
+				if (connection_send_response(conn) < 0) {
+					connection_remove(conn);
+					return;
+				}
+				if (conn->send_pos < conn->send_len)
+					return;
+				conn->state = STATE_DATA_SENT;
+				break;
+			}
+			if (conn->res_type == RESOURCE_TYPE_STATIC) {
+				enum connection_state next = connection_send_static(conn);
 
+				if (next == STATE_SENDING_DATA)
+					return;
+				conn->state = next;
+				break;
+			}
+			if (conn->pipefd[0] >= 0) {
+				enum connection_state next = connection_send_splice(conn);
+
+				if (next == STATE_SENDING_DATA)
+					return;
+				if (next == STATE_DATA_SENT)
+					connection_put_pipe(conn);
+				conn->state = next;
+				break;
+			}
+			if (connection_send_data(conn) < 0) {
+				connection_remove(conn);
+				return;
+			}
+			if (conn->send_pos < conn->send_len)
+				return;
+			if (connection_send_dynamic(conn) < 0)
+				conn->state = STATE_CONNECTION_CLOSED;
+			break;
+		case STATE_ASYNC_ONGOING:
+			return;
+		case STATE_DATA_SENT:
+		case STATE_404_SENT:
+			if (!conn->keep_alive) {
+				connection_remove(conn);
+				return;
+			}
+			/* Go on with the next request, which may be buffered already. */
+			connection_reset(conn);
+			break;
+		case STATE_CONNECTION_CLOSED:
+			connection_remove(conn);
+			return;
+		default:
+			ERR("Unexpected state\n");
+			exit(1);
+		}
+	}
+}
+
+void handle_input(struct connection *conn)
+{
 	switch (conn->state) {
+	case STATE_INITIAL:
+	case STATE_RECEIVING_DATA:
+		connection_run(conn);
+		/* The state it waits in starts now. */
+		connection_note_state(conn);
+		break;
 	default:
-		ERR("Unexpected state\n");
-		exit(1);
+		/* Input is read once the current reply is sent. */
+		break;
 	}
 }
 
 void handle_output(struct connection *conn)
 {
-	/* TODO: Handle output information: may be a new valid requests or notification of
-	 * completion of an asynchronous I/O operation or invalid requests.
-	 */
+	connection_run(conn);
+	connection_note_state(conn);
+}
 
+void handle_client(uint32_t event, struct connection *conn)
+{
 	switch (conn->state) {
+	case STATE_CONNECTION_CLOSED:
+		/* Closed earlier in this batch. */
+		return;
+	case STATE_ASYNC_ONGOING:
+		/* The read completion resumes the connection; it can't be freed before. */
+		return;
+	case STATE_INITIAL:
+	case STATE_RECEIVING_DATA:
+		if (event & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			handle_input(conn);
+		return;
 	default:
-		ERR("Unexpected state\n");
-		exit(1);
+		if (event & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			handle_output(conn);
+		return;
 	}
 }
 
-void handle_client(uint32_t event, struct connection *conn)
+/* Submit the reads of the connections waiting for room in the AIO context. */
+static void resume_aio_waiters(void)
 {
-	/* TODO: Handle new client. There can be input and output connections.
-	 * Take care of what happened at the end of a connection.
-	 */
+	struct connection *conn = aio_waiters, *tail = aio_waiters_tail, *next;
+
+	aio_waiters = NULL;
+	aio_waiters_tail = NULL;
+
+	for (; conn != NULL; conn = next) {
+		next = conn->next_aio_waiting;
+		conn->aio_waiting = 0;
+
+		connection_start_async_io(conn);
+		/* Still no room: it and the rest wait, in order, for more completions. */
+		if (conn->aio_waiting) {
+			conn->next_aio_waiting = next;
+			if (next != NULL)
+				aio_waiters_tail = tail;
+			return;
+		}
+		if (conn->state != STATE_ASYNC_ONGOING)
+			handle_output(conn);
+	}
+}
+
+/* Resume the connections whose asynchronous reads completed. */
+static void handle_aio_completions(void)
+{
+	struct io_event events[AWS_EPOLL_BATCH];
+	struct timespec no_wait = { 0, 0 };
+	uint64_t completed;
+	int n, i;
+
+	/* Reset the counter; completions are then reaped without blocking. */
+	if (read(aio_eventfd, &completed, sizeof(completed)) < 0)
+		return;
+
+	do {
+		n = io_getevents(ctx, 0, AWS_EPOLL_BATCH, events, &no_wait);
+		if (n < 0) {
+			dlog(LOG_ERR, "io_getevents failed: %d\n", n);
+			return;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct connection *conn = events[i].data;
+			struct aio_read *rd = (struct aio_read *)events[i].obj;
+
+			rd->res = (long)events[i].res;
+			rd->done = 1;
+			conn->reads_inflight--;
+			aio_inflight--;
+
+			if (conn->state == STATE_CONNECTION_CLOSED) {
+				if (conn->reads_inflight == 0)
+					connection_defer_free(conn);
+				continue;
+			}
+			/* Reads completing ahead of the one being sent wait for it. */
+			if (conn->state != STATE_ASYNC_ONGOING)
+				continue;
+
+			connection_complete_async_io(conn);
+			handle_output(conn);
+		}
+	} while (n == AWS_EPOLL_BATCH);
+
+	resume_aio_waiters();
 }
 
-int main(void)
+/* Event loop of one worker; never returns */
+void *aws_worker_run(void *arg)
 {
-	/* TODO: Initialize asynchronous operations. */
+	struct aws_worker *worker = arg;
+	int rc;
+
+	aws_worker_init(worker);
+
+	aio_depth = worker->aio_depth;
+	read_pool = (struct pool)POOL_INIT(aio_depth * sizeof(struct aio_read), AWS_POOL_MAX_FREE);
+	/* Chunks are large: keep few of them around. */
+	chunk_pool = (struct pool)POOL_INIT(worker->aio_chunk_size, AWS_AIO_MAX_EVENTS / 16);
+	splice_files = worker->splice_files;
+	pipe_size = worker->aio_chunk_size;
+
+	rc = io_setup(AWS_AIO_MAX_EVENTS, &ctx);
+	DIE(rc < 0, "io_setup");
+
+	epollfd = w_epoll_create();
+	DIE(epollfd < 0, "w_epoll_create");
+
+	listenfd = tcp_create_listener_reuseport(AWS_LISTEN_PORT, AWS_LISTEN_BACKLOG);
+	DIE(listenfd < 0, "tcp_create_listener_reuseport");
 
-	/* TODO: Initialize multiplexing. */
+	rc = fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+	DIE(rc < 0, "fcntl");
 
-	/* TODO: Create server socket. */
+	rc = w_epoll_add_ptr_in_et(epollfd, listenfd, &listenfd);
+	DIE(rc < 0, "w_epoll_add_ptr_in_et");
 
-	/* TODO: Add server socket to epoll object*/
+	aio_eventfd = eventfd(0, EFD_NONBLOCK);
+	DIE(aio_eventfd < 0, "eventfd");
 
-	/* Uncomment the following line for debugging. */
-	// dlog(LOG_INFO, "Server waiting for connections on port %d\n", AWS_LISTEN_PORT);
+	rc = w_epoll_add_ptr_in_et(epollfd, aio_eventfd, &aio_eventfd);
+	DIE(rc < 0, "w_epoll_add_ptr_in_et");
+
+	if (fd_cache_notify_fd(file_cache) >= 0) {
+		rc = w_epoll_add_ptr_in_et(epollfd, fd_cache_notify_fd(file_cache), file_cache);
+		DIE(rc < 0, "w_epoll_add_ptr_in_et");
+	}
+
+	dlog(LOG_INFO, "Worker %u waiting for connections on port %d\n",
+	     worker->id, AWS_LISTEN_PORT);
 
 	/* server main loop */
 	while (1) {
-		struct epoll_event rev;
+		struct epoll_event revs[AWS_EPOLL_BATCH];
+		int n, i;
+
+		if (accept_retry_ns != 0)
+			n = w_epoll_wait_batch_timeout(epollfd, revs, AWS_EPOLL_BATCH,
+						       accept_retry_ns > metrics_now_ns ?
+						       (accept_retry_ns - metrics_now_ns) / 1000000 + 1 : 0);
+		else
+			n = w_epoll_wait_batch(epollfd, revs, AWS_EPOLL_BATCH);
+		if (n < 0 && errno == EINTR)
+			continue;
+		DIE(n < 0, "w_epoll_wait_batch");
+		metrics_tick();
 
-		/* TODO: Wait for events. */
+		if (accept_retry_ns != 0 && metrics_now_ns >= accept_retry_ns) {
+			accept_retry_ns = 0;
+			handle_new_connection();
+		}
 
-		/*
-		 * TODO: Switch event types; consider
-		 *   - new connection requests (on server socket)
-		 *   - socket communication (on connection sockets)
-		 */
+		for (i = 0; i < n; i++) {
+			if (revs[i].data.ptr == &listenfd)
+				handle_new_connection();
+			else if (revs[i].data.ptr == &aio_eventfd)
+				handle_aio_completions();
+			else if (revs[i].data.ptr == file_cache)
+				fd_cache_handle_events(file_cache);
+			else
+				handle_client(revs[i].events, revs[i].data.ptr);
+		}
+
+		free_closed_connections();
+	}
+
+	return NULL;
+}
+
+#endif /* !AWS_IO_URING */
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-w workers] [-p] [-c files] [-b bytes] [-e replies]"
+		" [-d reads] [-s bytes] [-z]\n"
+		"  -w  number of worker threads, 0 for one per CPU (default 1)\n"
+		"  -p  pin worker i to the i-th CPU the server may run on\n"
+		"  -c  open files cached by each worker, 0 for none (default %d)\n"
+		"  -b  memory for cached replies of small dynamic files, per worker (default %d)\n"
+		"  -e  cached replies per worker, 0 for none (default %d)\n"
+		"  -d  asynchronous reads of a dynamic file in flight, 1 to %d (default %d)\n"
+		"  -s  size of these reads, and of pipes with -z, at least %d (default %d)\n"
+		"  -z  splice dynamic files larger than a cached reply, rather than read them\n",
+		argv0, AWS_FD_CACHE_SIZE, AWS_RESPONSE_CACHE_BYTES, AWS_RESPONSE_CACHE_ENTRIES,
+		AWS_AIO_MAX_DEPTH, AWS_AIO_DEPTH, BUFSIZ, AWS_AIO_CHUNK_SIZE);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct aws_worker *workers;
+	unsigned int num_workers = 1, i;
+	unsigned int cache_size = AWS_FD_CACHE_SIZE;
+	size_t response_bytes = AWS_RESPONSE_CACHE_BYTES;
+	unsigned int response_entries = AWS_RESPONSE_CACHE_ENTRIES;
+	unsigned int aio_depth = AWS_AIO_DEPTH;
+	size_t aio_chunk_size = AWS_AIO_CHUNK_SIZE;
+	int splice_files = 0;
+	int pin = 0, opt, rc;
+	cpu_set_t allowed;
+	struct rlimit nofile;
+	int cpu = -1;
+
+	while ((opt = getopt(argc, argv, "w:pc:b:e:d:s:z")) != -1) {
+		switch (opt) {
+		case 'w':
+			num_workers = atoi(optarg);
+			break;
+		case 'p':
+			pin = 1;
+			break;
+		case 'c':
+			cache_size = atoi(optarg);
+			break;
+		case 'b':
+			response_bytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'e':
+			response_entries = atoi(optarg);
+			break;
+		case 'd':
+			aio_depth = atoi(optarg);
+			break;
+		case 's':
+			aio_chunk_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'z':
+			splice_files = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || aio_depth < 1 || aio_depth > AWS_AIO_MAX_DEPTH ||
+	    aio_chunk_size < BUFSIZ)
+		usage(argv[0]);
+
+	rc = sched_getaffinity(0, sizeof(allowed), &allowed);
+	DIE(rc < 0, "sched_getaffinity");
+	if (num_workers == 0)
+		num_workers = CPU_COUNT(&allowed);
+
+	/* Errors on closed sockets are handled where they are returned. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Cached files may take up to half of the descriptors, sockets need the rest. */
+	rc = getrlimit(RLIMIT_NOFILE, &nofile);
+	DIE(rc < 0, "getrlimit");
+	nofile.rlim_cur = nofile.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &nofile) < 0)
+		getrlimit(RLIMIT_NOFILE, &nofile);
+	if (cache_size > nofile.rlim_cur / 2 / num_workers)
+		cache_size = nofile.rlim_cur / 2 / num_workers;
+
+	workers = calloc(num_workers, sizeof(*workers));
+	DIE(workers == NULL, "calloc");
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		workers[i].cpu = -1;
+		workers[i].fd_cache_size = cache_size;
+		workers[i].response_cache_bytes = response_bytes;
+		workers[i].response_cache_entries = response_entries;
+		workers[i].aio_depth = aio_depth;
+		workers[i].aio_chunk_size = aio_chunk_size;
+		workers[i].splice_files = splice_files;
+		if (pin) {
+			/* Next allowed CPU, wrapping around */
+			do {
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			} while (!CPU_ISSET(cpu, &allowed));
+			workers[i].cpu = cpu;
+		}
+	}
 
-		switch (rev.data.fd) { }
+	/* The main thread runs the first worker. */
+	for (i = 1; i < num_workers; i++) {
+		rc = pthread_create(&workers[i].thread, NULL, aws_worker_run, &workers[i]);
+		DIE(rc != 0, "pthread_create");
 	}
+	aws_worker_run(&workers[0]);
 
 	return 0;
 }
@@ -3,6 +3,14 @@
 #ifndef AWS_H_
 #define AWS_H_		1
 
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#ifndef AWS_IO_URING
+#include <libaio.h>
+#endif
+
 #include "http-parser/http_parser.h"
 
 #ifdef __cplusplus
@@ -15,6 +23,47 @@ extern "C" {
 #define AWS_REL_DYNAMIC_FOLDER	"dynamic/"
 #define AWS_ABS_STATIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_STATIC_FOLDER)
 #define AWS_ABS_DYNAMIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_DYNAMIC_FOLDER)
+/* Server metrics, in the Prometheus text format */
+#define AWS_METRICS_PATH	"/metrics"
+#define AWS_METRICS_CONTENT_TYPE	"text/plain; version=0.0.4; charset=utf-8"
+
+#define AWS_LISTEN_BACKLOG	4096
+/* Pause before accepting again when out of file descriptors or memory */
+#define AWS_ACCEPT_BACKOFF_MS	100
+/* Events handled per epoll_wait(2) */
+#define AWS_EPOLL_BATCH		64
+/* Asynchronous reads in flight, for all connections */
+#define AWS_AIO_MAX_EVENTS	1024
+/*
+ * Reads of a dynamic file kept in flight ahead of the socket, and their size,
+ * by default; files of up to BUFSIZ bytes are read in one BUFSIZ buffer.
+ */
+#define AWS_AIO_DEPTH		4
+#define AWS_AIO_MAX_DEPTH	64
+#define AWS_AIO_CHUNK_SIZE	(128 * 1024)
+/* Empty pipes kept by each worker for splicing dynamic files (-z) */
+#define AWS_PIPE_MAX_FREE	256
+
+/* Open files cached by each worker, by default */
+#define AWS_FD_CACHE_SIZE	4096
+
+/*
+ * Replies of dynamic files of up to one read (BUFSIZ) cached in memory by
+ * each worker, by default
+ */
+#define AWS_RESPONSE_CACHE_BYTES	(16 * 1024 * 1024)
+#define AWS_RESPONSE_CACHE_ENTRIES	1024
+#define AWS_RESPONSE_CACHE_MAX_BODY	BUFSIZ
+/* Room for the header of a 200 or 404 reply */
+#define AWS_REPLY_HEADER_MAX		128
+
+/* Free connections and buffers kept by each worker for reuse */
+#define AWS_POOL_MAX_FREE		1024
+
+/* io_uring backend: ring size, and registered read buffers of each worker */
+#define AWS_URING_ENTRIES	1024
+#define AWS_URING_BUFFERS	128
+#define AWS_URING_BUFFER_SIZE	(64 * 1024)
 
 enum connection_state {
 	STATE_INITIAL,
@@ -41,51 +90,145 @@ enum resource_type {
 	RESOURCE_TYPE_DYNAMIC
 };
 
-/* Structure acting as a connection handler */
+struct fd_cache;
+struct fd_cache_entry;
+struct response;
+struct response_cache;
+
+#ifndef AWS_IO_URING
+/* Asynchronous read of a chunk of a file, in flight or waiting to be sent */
+struct aio_read {
+	struct iocb iocb;	/* first: completions point back to the read */
+	char *buf;
+	size_t len;
+	long res;
+	int done;
+};
+#endif
+
+/*
+ * Structure acting as a connection handler. It is kept small, so that idle
+ * keep-alive connections are cheap: buffers are borrowed from the worker's
+ * buffer pool (aws_buffer_get()) only while they hold data or I/O is in
+ * flight, and are NULL otherwise.
+ */
 struct connection {
-    /* file to be sent */
+    /* file to be sent, from the worker's file cache */
+	struct fd_cache_entry *file;
 	int fd;
-	char filename[BUFSIZ];
+	/* whole cached reply, sent instead of reading the file */
+	struct response *response;
+	/* per-worker scratch space, valid while the request is handled */
+	char *filename;
 
-    /* asynchronous notification */
-	int eventfd;
 	int sockfd;
 
-	io_context_t ctx;
-	struct iocb iocb;
-	struct iocb *piocb[1];
+#ifndef AWS_IO_URING
+	/*
+	 * Ring of asynchronous reads, completed through the server's eventfd:
+	 * read_head is the next to send, read_tail the next to submit; both
+	 * count up, modulo the ring's depth. read_pos is the offset of the
+	 * next read, file_pos the end of what is sent.
+	 */
+	struct aio_read *reads;
+	unsigned int read_head, read_tail;
+	unsigned int reads_inflight;
+	size_t read_pos;
+	/* waiting for room in the AIO context, with no read in flight */
+	int aio_waiting;
+	struct connection *next_aio_waiting;
+	/* pipe the file is spliced to the socket through, -1 if not splicing */
+	int pipefd[2];
+	size_t pipe_len;	/* bytes in the pipe */
+#else
+	/* ring operations not completed yet; the connection is freed at 0 */
+	unsigned int inflight;
+	/* registered buffer file data is read into, -1 for send_buffer */
+	int buf_index;
+	char *buf;
+	size_t buf_size;
+	int send_more;		/* more rounds follow the current one */
+	/* sendmsg() of a cached reply */
+	struct msghdr msg;
+	struct iovec iov[2];
+#endif
 	size_t file_size;
 
-	/* buffers used for receiving messages */
-	char recv_buffer[BUFSIZ];
+	/* buffer used for receiving messages, BUFSIZ bytes */
+	char *recv_buffer;
 	size_t recv_len;
+	size_t request_len;	/* bytes of recv_buffer holding the current request */
+
+	/* Reply header or 404 */
+	char header[AWS_REPLY_HEADER_MAX];
 
-	/* Used for sending data (headers, 404 or data populated through async IO). */
-	char send_buffer[BUFSIZ];
+	/*
+	 * Data read from the file, being sent: the buffer of the read at
+	 * read_head, owned by the ring, or with io_uring a BUFSIZ buffer
+	 * borrowed from the pool.
+	 */
+	char *send_buffer;
 	size_t send_len;
 	size_t send_pos;
 	size_t file_pos;
 	size_t async_read_len;
 
-	/* HTTP request path */
+	/* HTTP request path, in per-worker scratch space */
 	int have_path;
-	char request_path[BUFSIZ];
+	int keep_alive;		/* the connection is reused after this reply */
+	char *request_path;
 	enum resource_type res_type;
 	enum connection_state state;
+	/* state last accounted for in the metrics, and since when */
+	enum connection_state metrics_state;
+	uint64_t state_since;
 
-	/* HTTP_REQUEST parser */
-	http_parser request_parser;
+	/* next in the list of closed connections, freed after each event batch */
+	struct connection *next_closed;
 };
 
+/* Worker settings, from the command line */
+struct aws_worker {
+	pthread_t thread;
+	unsigned int id;
+	int cpu;		/* CPU to pin the worker to, -1 for none */
+	unsigned int fd_cache_size;
+	size_t response_cache_bytes;
+	unsigned int response_cache_entries;
+	unsigned int aio_depth;
+	size_t aio_chunk_size;
+	int splice_files;	/* splice large dynamic files rather than read them */
+};
+
+/* Open files of the calling worker */
+extern __thread struct fd_cache *file_cache;
+/* Cached replies of small dynamic files of the calling worker */
+extern __thread struct response_cache *response_cache;
+
+int aws_format_reply_header(char *buf, size_t size, size_t length, int keep_alive,
+			    const char *content_type);
+
+/* Event loop of one worker, of the backend chosen at build time; never returns */
+void *aws_worker_run(void *arg);
+void aws_worker_init(const struct aws_worker *worker);
+
 void handle_client(uint32_t event, struct connection *conn);
 void handle_new_connection(void);
 void handle_input(struct connection *conn);
 void handle_output(struct connection *conn);
 
 struct connection *connection_create(int sockfd);
+void connection_free(struct connection *conn);
+/* Account the time spent in the previous state, if the connection left it */
+void connection_note_state(struct connection *conn);
+
+/* Buffers of BUFSIZ bytes, from the worker's pool */
+char *aws_buffer_get(void);
+void aws_buffer_put(char *buf);
 void connection_remove(struct connection *conn);
 
 int connection_open_file(struct connection *conn);
+void connection_close_file(struct connection *conn);
 
 int connection_send_dynamic(struct connection *conn);
 void connection_start_async_io(struct connection *conn);
@@ -94,6 +237,9 @@ void connection_complete_async_io(struct connection *conn);
 void connection_start_async_io(struct connection *conn);
 
 int parse_header(struct connection *conn);
+int connection_find_request(struct connection *conn);
+void handle_request(struct connection *conn);
+void connection_reset(struct connection *conn);
 
 void receive_data(struct connection *conn);
 
@@ -0,0 +1,547 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * io_uring backend of the server, built with `make IO_URING=1` instead of
+ * the epoll and libaio one in aws.c.
+ *
+ * Accepts, receives, file reads and sends all go through one ring per
+ * worker. A file is sent in rounds: a read into the connection's buffer
+ * linked to the send of that buffer, so a round costs no system call of its
+ * own. The reply header is put in front of the first chunk and goes out
+ * with it. The worker only enters the kernel once per batch of completions,
+ * to submit every new request and wait for the next completions.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+#include "aws.h"
+#include "fd_cache.h"
+#include "response_cache.h"
+#include "metrics.h"
+#include "utils/util.h"
+#include "utils/debug.h"
+#include "utils/sock_util.h"
+#include "utils/w_uring.h"
+
+/*
+ * Operation of a request, in the low bits of its user_data, next to the
+ * connection; malloc() aligns connections to 16 bytes at least.
+ */
+enum uring_op {
+	URING_ACCEPT,
+	URING_RECV,
+	URING_READ,
+	URING_SEND,
+	URING_NOTIFY,		/* file cache notifications to read */
+	URING_POLL,		/* input on an idle connection */
+	URING_ACCEPT_RETRY,	/* end of the pause after a failed accept */
+	URING_OP_MASK = 7
+};
+
+static __thread struct w_uring ring;
+
+/*
+ * Completions set aside, oldest first, to make room in the completion queue
+ * when the kernel took no submissions until some were reaped.
+ */
+struct uring_completion {
+	__u64 user_data;
+	int res;
+};
+static __thread struct uring_completion *backlog;
+static __thread unsigned int backlog_len, backlog_cap;
+
+/* server socket file descriptor */
+static __thread int listenfd;
+
+/* Read buffers, registered with the ring if the kernel allows it */
+static __thread char *buffers;
+static __thread int buffers_registered;
+static __thread int free_buffers[AWS_URING_BUFFERS];
+static __thread int num_free_buffers;
+
+static void setup_buffers(void)
+{
+	struct iovec iov[AWS_URING_BUFFERS];
+	int i;
+
+	buffers = aligned_alloc(4096, (size_t)AWS_URING_BUFFERS * AWS_URING_BUFFER_SIZE);
+	DIE(buffers == NULL, "aligned_alloc");
+
+	for (i = 0; i < AWS_URING_BUFFERS; i++) {
+		iov[i].iov_base = buffers + (size_t)i * AWS_URING_BUFFER_SIZE;
+		iov[i].iov_len = AWS_URING_BUFFER_SIZE;
+		free_buffers[i] = AWS_URING_BUFFERS - 1 - i;
+	}
+	num_free_buffers = AWS_URING_BUFFERS;
+
+	/* Pinning the buffers may exceed RLIMIT_MEMLOCK on older kernels. */
+	buffers_registered = w_uring_register_buffers(&ring, iov, AWS_URING_BUFFERS) == 0;
+	if (!buffers_registered)
+		dlog(LOG_WARNING, "Read buffers not registered: %s\n", strerror(errno));
+}
+
+/*
+ * Take a registered buffer for a file reply; borrow a send_buffer from the
+ * worker's pool if none is left.
+ */
+static int connection_get_buffer(struct connection *conn)
+{
+	if (num_free_buffers == 0) {
+		conn->send_buffer = aws_buffer_get();
+		if (conn->send_buffer == NULL)
+			return -1;
+		conn->buf_index = -1;
+		conn->buf = conn->send_buffer;
+		conn->buf_size = BUFSIZ;
+		return 0;
+	}
+
+	conn->buf_index = free_buffers[--num_free_buffers];
+	conn->buf = buffers + (size_t)conn->buf_index * AWS_URING_BUFFER_SIZE;
+	conn->buf_size = AWS_URING_BUFFER_SIZE;
+	return 0;
+}
+
+static void connection_put_buffer(struct connection *conn)
+{
+	if (conn->buf_index >= 0)
+		free_buffers[num_free_buffers++] = conn->buf_index;
+	if (conn->send_buffer != NULL) {
+		aws_buffer_put(conn->send_buffer);
+		conn->send_buffer = NULL;
+	}
+	conn->buf_index = -1;
+	conn->buf = NULL;
+}
+
+/* Set the completions in the queue aside; returns how many there were */
+static unsigned int backlog_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int reaped = 0;
+
+	while ((cqe = w_uring_peek_cqe(&ring)) != NULL) {
+		if (backlog_len == backlog_cap) {
+			unsigned int cap = backlog_cap ? 2 * backlog_cap : AWS_URING_ENTRIES;
+			struct uring_completion *b = realloc(backlog, cap * sizeof(*b));
+
+			DIE(b == NULL, "realloc");
+			backlog = b;
+			backlog_cap = cap;
+		}
+		backlog[backlog_len].user_data = cqe->user_data;
+		backlog[backlog_len].res = cqe->res;
+		backlog_len++;
+		reaped++;
+		w_uring_cqe_seen(&ring);
+	}
+
+	return reaped;
+}
+
+/*
+ * After io_uring_enter failed with EBUSY or EAGAIN: reap the completions,
+ * to be handled later by the event loop, so that submitting can be tried
+ * again. Completions the kernel kept back for lack of room in the queue are
+ * flushed to it first; with none at all, the kernel is short of memory and
+ * gets a moment. Returns -1 on other errors.
+ */
+static int ring_make_room(void)
+{
+	const struct timespec pause = { 0, 1000000 };
+
+	if (errno != EBUSY && errno != EAGAIN)
+		return -1;
+
+	if (backlog_reap() > 0)
+		return 0;
+	if (w_uring_wait(&ring, 0) < 0 && errno != EBUSY && errno != EAGAIN)
+		return -1;
+	if (backlog_reap() == 0)
+		nanosleep(&pause, NULL);
+	return 0;
+}
+
+static struct io_uring_sqe *connection_get_sqe(struct connection *conn, enum uring_op op)
+{
+	struct io_uring_sqe *sqe;
+
+	while ((sqe = w_uring_get_sqe(&ring)) == NULL)
+		DIE(ring_make_room() < 0, "io_uring_enter");
+	sqe->user_data = (uintptr_t)conn | op;
+	if (conn != NULL)
+		conn->inflight++;
+
+	return sqe;
+}
+
+static void submit_accept(void)
+{
+	struct io_uring_sqe *sqe = connection_get_sqe(NULL, URING_ACCEPT);
+
+	w_uring_prep_accept(sqe, listenfd, SOCK_CLOEXEC);
+}
+
+/* Accept again later: until some connection closes, accept would fail again. */
+static void submit_accept_retry(void)
+{
+	static const struct __kernel_timespec delay = {
+		.tv_nsec = AWS_ACCEPT_BACKOFF_MS * 1000000L
+	};
+	struct io_uring_sqe *sqe = connection_get_sqe(NULL, URING_ACCEPT_RETRY);
+
+	w_uring_prep_timeout(sqe, &delay);
+}
+
+static void submit_notify_poll(void)
+{
+	struct io_uring_sqe *sqe = connection_get_sqe(NULL, URING_NOTIFY);
+
+	w_uring_prep_poll_add(sqe, fd_cache_notify_fd(file_cache), POLLIN);
+}
+
+/* Wait for input without holding a buffer */
+static void submit_poll(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = connection_get_sqe(conn, URING_POLL);
+
+	w_uring_prep_poll_add(sqe, conn->sockfd, POLLIN);
+	conn->state = STATE_RECEIVING_DATA;
+	connection_note_state(conn);
+}
+
+static void submit_recv(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = connection_get_sqe(conn, URING_RECV);
+
+	w_uring_prep_recv(sqe, conn->sockfd, conn->recv_buffer + conn->recv_len,
+			  BUFSIZ - 1 - conn->recv_len, 0);
+	conn->state = STATE_RECEIVING_DATA;
+	connection_note_state(conn);
+}
+
+/* Send what is left of buf or of the cached reply, without a read in front */
+static void submit_send(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = connection_get_sqe(conn, URING_SEND);
+
+	/* Every reply, and every round of it, ends with a send. */
+	connection_note_state(conn);
+
+	if (conn->response != NULL) {
+		conn->msg.msg_iov = conn->iov;
+		conn->msg.msg_iovlen = response_iov(conn->response, conn->keep_alive,
+						    conn->send_pos, conn->iov);
+		w_uring_prep_sendmsg(sqe, conn->sockfd, &conn->msg, MSG_NOSIGNAL | MSG_WAITALL);
+		return;
+	}
+
+	/* Later rounds follow: don't push the end of this one in a short segment. */
+	w_uring_prep_send(sqe, conn->sockfd, conn->buf + conn->send_pos,
+			  conn->send_len - conn->send_pos,
+			  MSG_NOSIGNAL | MSG_WAITALL | (conn->send_more ? MSG_MORE : 0));
+}
+
+/*
+ * Submit the next round of a reply: the next chunk of the file is read after
+ * the header bytes already in buf, and the send of the whole buffer is
+ * linked to the read.
+ */
+static void submit_round(struct connection *conn, size_t header_len)
+{
+	size_t chunk = conn->file_size - conn->file_pos;
+
+	if (chunk > conn->buf_size - header_len)
+		chunk = conn->buf_size - header_len;
+
+	conn->send_len = header_len + chunk;
+	conn->send_pos = 0;
+	conn->async_read_len = chunk;
+	conn->send_more = conn->file_pos + chunk < conn->file_size;
+	conn->state = STATE_SENDING_DATA;
+
+	if (chunk > 0) {
+		struct io_uring_sqe *sqe;
+		char *dst = conn->buf + header_len;
+
+		/* The read and its send must go to the kernel together. */
+		while (w_uring_reserve(&ring, 2) < 0)
+			DIE(ring_make_room() < 0, "io_uring_enter");
+		sqe = connection_get_sqe(conn, URING_READ);
+
+		if (conn->buf_index >= 0 && buffers_registered)
+			w_uring_prep_read_fixed(sqe, conn->fd, dst, chunk, conn->file_pos,
+						conn->buf_index);
+		else
+			w_uring_prep_read(sqe, conn->fd, dst, chunk, conn->file_pos);
+		sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	submit_send(conn);
+}
+
+static void connection_close(struct connection *conn)
+{
+	/* Requests still in flight hold their own references to the files. */
+	connection_close_file(conn);
+	close(conn->sockfd);
+	conn->state = STATE_CONNECTION_CLOSED;
+	connection_note_state(conn);
+
+	if (conn->inflight == 0) {
+		connection_put_buffer(conn);
+		connection_free(conn);
+	}
+}
+
+static void start_reply(struct connection *conn)
+{
+	handle_request(conn);
+
+	if (conn->response != NULL) {
+		submit_send(conn);
+		return;
+	}
+
+	if (conn->state == STATE_SENDING_404) {
+		conn->buf_index = -1;
+		conn->buf = conn->header;
+		conn->buf_size = sizeof(conn->header);
+		submit_round(conn, conn->send_len);
+		return;
+	}
+
+	if (connection_get_buffer(conn) < 0) {
+		connection_close(conn);
+		return;
+	}
+	memcpy(conn->buf, conn->header, conn->send_len);
+	submit_round(conn, conn->send_len);
+}
+
+/*
+ * Reply to the next request if it is received, otherwise receive more. An
+ * idle connection waits for input first, and only then borrows a buffer.
+ */
+static void continue_receive(struct connection *conn)
+{
+	if (connection_find_request(conn)) {
+		start_reply(conn);
+		return;
+	}
+	if (conn->recv_len == 0) {
+		submit_poll(conn);
+		return;
+	}
+	submit_recv(conn);
+}
+
+static void receive_ready(struct connection *conn)
+{
+	if (conn->recv_buffer == NULL) {
+		conn->recv_buffer = aws_buffer_get();
+		if (conn->recv_buffer == NULL) {
+			connection_close(conn);
+			return;
+		}
+	}
+	submit_recv(conn);
+}
+
+static void finish_reply(struct connection *conn)
+{
+	connection_put_buffer(conn);
+
+	if (!conn->keep_alive) {
+		connection_close(conn);
+		return;
+	}
+
+	connection_reset(conn);
+	continue_receive(conn);
+}
+
+static void handle_accept(int res)
+{
+	struct connection *conn;
+
+	if (res < 0) {
+		dlog(LOG_ERR, "accept failed: %s\n", strerror(-res));
+		if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM)
+			submit_accept_retry();
+		else
+			submit_accept();
+		return;
+	}
+
+	submit_accept();
+
+	conn = connection_create(res);
+	if (conn == NULL) {
+		ERR("connection_create");
+		close(res);
+		return;
+	}
+	conn->buf_index = -1;
+
+	submit_poll(conn);
+}
+
+static void handle_completion(__u64 user_data, int res)
+{
+	struct connection *conn = (struct connection *)(uintptr_t)(user_data & ~(__u64)URING_OP_MASK);
+	enum uring_op op = user_data & URING_OP_MASK;
+
+	if (op == URING_ACCEPT) {
+		handle_accept(res);
+		return;
+	}
+	if (op == URING_ACCEPT_RETRY) {
+		submit_accept();
+		return;
+	}
+	if (op == URING_NOTIFY) {
+		fd_cache_handle_events(file_cache);
+		submit_notify_poll();
+		return;
+	}
+
+	conn->inflight--;
+	if (conn->state == STATE_CONNECTION_CLOSED) {
+		if (conn->inflight == 0) {
+			connection_put_buffer(conn);
+			connection_free(conn);
+		}
+		return;
+	}
+
+	switch (op) {
+	case URING_POLL:
+		if (res < 0) {
+			connection_close(conn);
+			return;
+		}
+		receive_ready(conn);
+		break;
+	case URING_RECV:
+		if (res <= 0) {
+			connection_close(conn);
+			return;
+		}
+		conn->recv_len += res;
+		conn->recv_buffer[conn->recv_len] = '\0';
+		continue_receive(conn);
+		break;
+	case URING_READ:
+		/* A failed or short read cancels the linked send. */
+		if (res <= 0) {
+			connection_close(conn);
+			return;
+		}
+		/* A small dynamic file read whole: keep its reply for the next requests. */
+		if (conn->file_pos == 0 && res == conn->file_size &&
+		    conn->res_type == RESOURCE_TYPE_DYNAMIC)
+			response_cache_add(response_cache, conn->file,
+					   conn->buf + conn->send_len - conn->async_read_len, res);
+		conn->send_len -= conn->async_read_len - res;
+		conn->file_pos += res;
+		break;
+	case URING_SEND:
+		if (res == -ECANCELED) {
+			/* The read in front of it was short: send what it read. */
+			submit_send(conn);
+			return;
+		}
+		if (res < 0) {
+			connection_close(conn);
+			return;
+		}
+		/* Reply headers are sent with the first chunk of a file. */
+		metrics_add(&worker_metrics->sent_bytes[conn->response != NULL ?
+				METRICS_SOURCE_CACHE : conn->res_type == RESOURCE_TYPE_NONE ?
+				METRICS_SOURCE_HEADER : METRICS_SOURCE_ASYNC], res);
+		conn->send_pos += res;
+		if (conn->send_pos < conn->send_len)
+			submit_send(conn);
+		else if (conn->response == NULL && conn->file_pos < conn->file_size)
+			submit_round(conn, 0);
+		else
+			finish_reply(conn);
+		break;
+	default:
+		ERR("Unexpected completion\n");
+		exit(1);
+	}
+}
+
+/* Handle the completions set aside, then those in the queue, in order */
+static void handle_completions(void)
+{
+	struct io_uring_cqe *cqe;
+	__u64 user_data;
+	unsigned int i;
+	int res;
+
+	while (1) {
+		/* Handlers may set more aside, behind these. */
+		for (i = 0; i < backlog_len; i++)
+			handle_completion(backlog[i].user_data, backlog[i].res);
+		backlog_len = 0;
+
+		cqe = w_uring_peek_cqe(&ring);
+		if (cqe == NULL)
+			return;
+
+		user_data = cqe->user_data;
+		res = cqe->res;
+		w_uring_cqe_seen(&ring);
+		handle_completion(user_data, res);
+	}
+}
+
+/* Event loop of one worker; never returns */
+void *aws_worker_run(void *arg)
+{
+	struct aws_worker *worker = arg;
+	int rc;
+
+	aws_worker_init(worker);
+
+	/* Completions may outnumber submissions: every connection has one pending. */
+	rc = w_uring_setup(&ring, AWS_URING_ENTRIES, 4 * AWS_URING_ENTRIES);
+	DIE(rc < 0, "io_uring_setup");
+
+	setup_buffers();
+
+	listenfd = tcp_create_listener_reuseport(AWS_LISTEN_PORT, AWS_LISTEN_BACKLOG);
+	DIE(listenfd < 0, "tcp_create_listener_reuseport");
+
+	dlog(LOG_INFO, "Worker %u waiting for connections on port %d (io_uring)\n",
+	     worker->id, AWS_LISTEN_PORT);
+
+	submit_accept();
+	if (fd_cache_notify_fd(file_cache) >= 0)
+		submit_notify_poll();
+
+	/* server main loop */
+	while (1) {
+		rc = w_uring_submit_and_wait(&ring, 1);
+		DIE(rc < 0 && ring_make_room() < 0, "io_uring_enter");
+		metrics_tick();
+
+		handle_completions();
+	}
+
+	return NULL;
+}
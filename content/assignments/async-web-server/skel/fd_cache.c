@@ -0,0 +1,368 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "fd_cache.h"
+#include "utils/debug.h"
+
+#define FD_CACHE_WATCH_EVENTS	(IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+				 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+				 IN_MOVE_SELF | IN_ONLYDIR)
+
+/* A watched directory of cached files */
+struct fd_cache_watch {
+	int wd;
+	char *dir;
+};
+
+struct fd_cache {
+	unsigned int capacity;
+	unsigned int count;
+
+	/* buckets of entries by path and by real path; the count is a power of two */
+	struct fd_cache_entry **buckets;
+	struct fd_cache_entry **real_buckets;
+	unsigned int bucket_mask;
+
+	/* most recently used first */
+	struct fd_cache_entry *lru_head, *lru_tail;
+
+	void (*drop_data)(void *data);
+
+	int notify_fd;
+	struct fd_cache_watch *watches;
+	unsigned int num_watches, watches_cap;
+};
+
+/* FNV-1a */
+static uint32_t path_hash(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	while (*path != '\0') {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+struct fd_cache *fd_cache_create(unsigned int capacity)
+{
+	struct fd_cache *cache = calloc(1, sizeof(*cache));
+	unsigned int buckets = 16;
+
+	if (cache == NULL)
+		return NULL;
+
+	cache->notify_fd = -1;
+	if (capacity > 0) {
+		cache->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (cache->notify_fd < 0) {
+			/* Entries could not be invalidated: don't cache. */
+			dlog(LOG_WARNING, "inotify_init1 failed, files are not cached\n");
+			capacity = 0;
+		}
+	}
+	cache->capacity = capacity;
+
+	while (buckets < 2 * capacity)
+		buckets *= 2;
+	cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+	cache->real_buckets = calloc(buckets, sizeof(*cache->real_buckets));
+	if (cache->buckets == NULL || cache->real_buckets == NULL) {
+		if (cache->notify_fd >= 0)
+			close(cache->notify_fd);
+		free(cache->buckets);
+		free(cache->real_buckets);
+		free(cache);
+		return NULL;
+	}
+	cache->bucket_mask = buckets - 1;
+
+	return cache;
+}
+
+void fd_cache_set_drop_data(struct fd_cache *cache, void (*drop_data)(void *data))
+{
+	cache->drop_data = drop_data;
+}
+
+int fd_cache_notify_fd(struct fd_cache *cache)
+{
+	return cache->notify_fd;
+}
+
+static void lru_unlink(struct fd_cache *cache, struct fd_cache_entry *entry)
+{
+	if (entry->lru_prev != NULL)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next != NULL)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct fd_cache *cache, struct fd_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head != NULL)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static void entry_free(struct fd_cache_entry *entry)
+{
+	close(entry->fd);
+	free(entry->path);
+	free(entry->real_path);
+	free(entry);
+}
+
+/* Take an entry out of the cache; it is freed when its last user is done. */
+static void entry_drop(struct fd_cache *cache, struct fd_cache_entry *entry)
+{
+	struct fd_cache_entry **p = &cache->buckets[path_hash(entry->path) & cache->bucket_mask];
+
+	while (*p != entry)
+		p = &(*p)->hash_next;
+	*p = entry->hash_next;
+	entry->hash_next = NULL;
+
+	p = &cache->real_buckets[path_hash(entry->real_path) & cache->bucket_mask];
+	while (*p != entry)
+		p = &(*p)->real_next;
+	*p = entry->real_next;
+	entry->real_next = NULL;
+
+	lru_unlink(cache, entry);
+	entry->cached = 0;
+	cache->count--;
+
+	if (entry->data != NULL && cache->drop_data != NULL)
+		cache->drop_data(entry->data);
+	entry->data = NULL;
+
+	if (entry->refs == 0)
+		entry_free(entry);
+}
+
+static void drop_all(struct fd_cache *cache)
+{
+	while (cache->lru_head != NULL)
+		entry_drop(cache, cache->lru_head);
+}
+
+static struct fd_cache_entry *lookup(struct fd_cache *cache, const char *path)
+{
+	struct fd_cache_entry *entry = cache->buckets[path_hash(path) & cache->bucket_mask];
+
+	while (entry != NULL && strcmp(entry->path, path) != 0)
+		entry = entry->hash_next;
+
+	return entry;
+}
+
+/* Drop the entries of the files at path, by the path or the file they resolve to */
+static void drop_path(struct fd_cache *cache, const char *path)
+{
+	struct fd_cache_entry *entry, *next;
+
+	entry = lookup(cache, path);
+	if (entry != NULL)
+		entry_drop(cache, entry);
+
+	for (entry = cache->real_buckets[path_hash(path) & cache->bucket_mask];
+	     entry != NULL; entry = next) {
+		next = entry->real_next;
+		if (strcmp(entry->real_path, path) == 0)
+			entry_drop(cache, entry);
+	}
+}
+
+/* Watch the directory of path, once per directory */
+static int watch_dir(struct fd_cache *cache, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	size_t len = slash != NULL ? (size_t)(slash - path) : 1;
+	struct fd_cache_watch *w;
+	char *dir;
+	unsigned int i;
+	int wd;
+
+	for (i = 0; i < cache->num_watches; i++) {
+		dir = cache->watches[i].dir;
+		if (strncmp(dir, slash != NULL ? path : ".", len) == 0 && dir[len] == '\0')
+			return 0;
+	}
+
+	dir = slash != NULL ? strndup(path, len) : strdup(".");
+	if (dir == NULL)
+		return -1;
+
+	wd = inotify_add_watch(cache->notify_fd, dir, FD_CACHE_WATCH_EVENTS);
+	if (wd < 0)
+		goto err_free;
+
+	if (cache->num_watches == cache->watches_cap) {
+		unsigned int cap = cache->watches_cap ? 2 * cache->watches_cap : 8;
+
+		w = realloc(cache->watches, cap * sizeof(*w));
+		if (w == NULL)
+			goto err_free;
+		cache->watches = w;
+		cache->watches_cap = cap;
+	}
+
+	w = &cache->watches[cache->num_watches++];
+	w->wd = wd;
+	w->dir = dir;
+	return 0;
+
+err_free:
+	free(dir);
+	return -1;
+}
+
+struct fd_cache_entry *fd_cache_get(struct fd_cache *cache, const char *path)
+{
+	struct fd_cache_entry *entry;
+	struct stat st;
+	int fd;
+
+	if (cache->capacity > 0) {
+		entry = lookup(cache, path);
+		if (entry != NULL) {
+			lru_unlink(cache, entry);
+			lru_push_front(cache, entry);
+			entry->refs++;
+			return entry;
+		}
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+		free(entry);
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	entry->fd = fd;
+	entry->size = st.st_size;
+	entry->refs = 1;
+
+	/* Files whose changes we wouldn't hear of are not cached. */
+	if (cache->capacity == 0)
+		return entry;
+	entry->real_path = realpath(path, NULL);
+	if (entry->real_path == NULL || watch_dir(cache, path) < 0 ||
+	    watch_dir(cache, entry->real_path) < 0) {
+		free(entry->real_path);
+		entry->real_path = NULL;
+		return entry;
+	}
+
+	if (cache->count == cache->capacity)
+		entry_drop(cache, cache->lru_tail);
+
+	entry->hash_next = cache->buckets[path_hash(path) & cache->bucket_mask];
+	cache->buckets[path_hash(path) & cache->bucket_mask] = entry;
+	entry->real_next = cache->real_buckets[path_hash(entry->real_path) & cache->bucket_mask];
+	cache->real_buckets[path_hash(entry->real_path) & cache->bucket_mask] = entry;
+	lru_push_front(cache, entry);
+	entry->cached = 1;
+	cache->count++;
+
+	return entry;
+}
+
+void fd_cache_put(struct fd_cache *cache, struct fd_cache_entry *entry)
+{
+	if (--entry->refs == 0 && !entry->cached)
+		entry_free(entry);
+}
+
+static void handle_event(struct fd_cache *cache, const struct inotify_event *ev)
+{
+	char path[PATH_MAX];
+	unsigned int i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* Some events were lost. */
+		drop_all(cache);
+		return;
+	}
+
+	if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+		/* The directory itself is gone or moved: its paths mean nothing now. */
+		drop_all(cache);
+		if (!(ev->mask & IN_IGNORED))
+			return;
+		for (i = 0; i < cache->num_watches; i++) {
+			if (cache->watches[i].wd == ev->wd) {
+				free(cache->watches[i].dir);
+				cache->watches[i--] = cache->watches[--cache->num_watches];
+			}
+		}
+		return;
+	}
+
+	if (ev->len == 0)
+		return;
+
+	for (i = 0; i < cache->num_watches; i++) {
+		if (cache->watches[i].wd != ev->wd)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cache->watches[i].dir, ev->name);
+		drop_path(cache, path);
+	}
+}
+
+void fd_cache_handle_events(struct fd_cache *cache)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	char *p;
+
+	if (cache->notify_fd < 0)
+		return;
+
+	while ((n = read(cache->notify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) +
+		     ((struct inotify_event *)p)->len)
+			handle_event(cache, (struct inotify_event *)p);
+	}
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef FD_CACHE_H_
+#define FD_CACHE_H_	1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LRU cache of open, read-only file descriptors of regular files, keyed by
+ * path, with the files' sizes. A hit saves the open() and fstat() of a
+ * request.
+ *
+ * The directories of cached files are watched with inotify: entries of
+ * files that are modified, replaced or removed are dropped once
+ * fd_cache_handle_events() reads the notifications. Both the directory of
+ * the path and that of the file it resolves to are watched, so files
+ * reached through symbolic links are dropped when their targets change.
+ * The cache is not thread-safe; every worker has its own.
+ */
+
+struct fd_cache_entry {
+	char *path;
+	char *real_path;	/* path resolved by realpath(), NULL if not cached */
+	int fd;
+	size_t size;
+
+	/* attached by the user, released by the cache's drop_data hook */
+	void *data;
+
+	unsigned int refs;	/* users, the cache itself excluded */
+	int cached;		/* still in the cache, not dropped */
+	struct fd_cache_entry *hash_next;
+	struct fd_cache_entry *real_next;	/* entries of the same real_path bucket */
+	struct fd_cache_entry *lru_prev, *lru_next;
+};
+
+struct fd_cache;
+
+/* A cache of at most capacity files; 0 opens every file anew */
+struct fd_cache *fd_cache_create(unsigned int capacity);
+
+/* Called with the data of entries taken out of the cache, if they have any */
+void fd_cache_set_drop_data(struct fd_cache *cache, void (*drop_data)(void *data));
+
+/* Descriptor to wait on for fd_cache_handle_events(); nonblocking */
+int fd_cache_notify_fd(struct fd_cache *cache);
+
+/*
+ * Open entry of a regular file, from the cache or opened now. Returns NULL
+ * with errno set on failure. Release it with fd_cache_put().
+ */
+struct fd_cache_entry *fd_cache_get(struct fd_cache *cache, const char *path);
+void fd_cache_put(struct fd_cache *cache, struct fd_cache_entry *entry);
+
+/* Drop the entries of files changed since the last call */
+void fd_cache_handle_events(struct fd_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FD_CACHE_H_ */
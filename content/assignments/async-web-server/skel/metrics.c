@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aws.h"
+#include "metrics.h"
+#include "response_cache.h"
+
+__thread struct metrics *worker_metrics;
+__thread uint64_t metrics_now_ns;
+
+/* Metrics of every worker, most recently started first */
+static struct metrics *all_metrics;
+
+static const uint64_t bucket_ns[METRICS_BUCKETS] = {
+	10000, 50000, 100000, 500000,
+	1000000, 5000000, 10000000, 50000000,
+	100000000, 500000000, 1000000000, 5000000000ULL,
+	10000000000ULL
+};
+
+static const char * const state_names[STATE_NO_STATE] = {
+	[STATE_INITIAL] = "initial",
+	[STATE_RECEIVING_DATA] = "receiving_data",
+	[STATE_REQUEST_RECEIVED] = "request_received",
+	[STATE_SENDING_DATA] = "sending_data",
+	[STATE_SENDING_HEADER] = "sending_header",
+	[STATE_SENDING_404] = "sending_404",
+	[STATE_ASYNC_ONGOING] = "async_ongoing",
+	[STATE_DATA_SENT] = "data_sent",
+	[STATE_HEADER_SENT] = "header_sent",
+	[STATE_404_SENT] = "404_sent",
+	[STATE_CONNECTION_CLOSED] = NULL	/* never left */
+};
+
+static const char * const source_names[METRICS_SOURCES] = {
+	"header", "sendfile", "async", "splice", "cache"
+};
+
+static const char * const op_names[METRICS_OPS] = {
+	"recv", "send", "sendfile", "splice"
+};
+
+static const char * const code_names[METRICS_CODES] = { "200", "404" };
+
+int metrics_init(void)
+{
+	worker_metrics = calloc(1, sizeof(*worker_metrics));
+	if (worker_metrics == NULL)
+		return -1;
+
+	metrics_tick();
+
+	/* Published once set up; never taken out. */
+	worker_metrics->next = __atomic_load_n(&all_metrics, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&all_metrics, &worker_metrics->next, worker_metrics,
+					    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return 0;
+}
+
+void metrics_tick(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	metrics_now_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_dwell(enum connection_state state, uint64_t ns)
+{
+	struct metrics_histogram *hist = &worker_metrics->dwell[state];
+	unsigned int i;
+
+	for (i = 0; i < METRICS_BUCKETS && ns > bucket_ns[i]; i++)
+		;
+	metrics_add(&hist->buckets[i], 1);
+	metrics_add(&hist->sum_ns, ns);
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Sum of the metrics of all workers */
+static void metrics_sum(struct metrics *sum)
+{
+	struct metrics *m;
+	unsigned int i, j;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (m = __atomic_load_n(&all_metrics, __ATOMIC_ACQUIRE); m != NULL; m = m->next) {
+		sum->connections_opened += load(&m->connections_opened);
+		sum->connections_closed += load(&m->connections_closed);
+		for (i = 0; i < METRICS_CODES; i++)
+			sum->requests[i] += load(&m->requests[i]);
+		for (i = 0; i < METRICS_SOURCES; i++)
+			sum->sent_bytes[i] += load(&m->sent_bytes[i]);
+		for (i = 0; i < METRICS_OPS; i++)
+			sum->eagain[i] += load(&m->eagain[i]);
+		for (i = 0; i < STATE_NO_STATE; i++) {
+			for (j = 0; j <= METRICS_BUCKETS; j++)
+				sum->dwell[i].buckets[j] += load(&m->dwell[i].buckets[j]);
+			sum->dwell[i].sum_ns += load(&m->dwell[i].sum_ns);
+		}
+	}
+}
+
+static void metrics_write_histograms(FILE *f, const struct metrics *sum)
+{
+	unsigned int i, j;
+
+	fprintf(f, "# HELP aws_state_dwell_seconds Time connections spent in a state before leaving it.\n"
+		"# TYPE aws_state_dwell_seconds histogram\n");
+
+	for (i = 0; i < STATE_NO_STATE; i++) {
+		const struct metrics_histogram *hist = &sum->dwell[i];
+		uint64_t count = 0;
+
+		if (state_names[i] == NULL)
+			continue;
+
+		for (j = 0; j < METRICS_BUCKETS; j++) {
+			count += hist->buckets[j];
+			fprintf(f, "aws_state_dwell_seconds_bucket{state=\"%s\",le=\"%g\"} %llu\n",
+				state_names[i], bucket_ns[j] / 1e9, (unsigned long long)count);
+		}
+		count += hist->buckets[METRICS_BUCKETS];
+		fprintf(f, "aws_state_dwell_seconds_bucket{state=\"%s\",le=\"+Inf\"} %llu\n"
+			"aws_state_dwell_seconds_sum{state=\"%s\"} %.9f\n"
+			"aws_state_dwell_seconds_count{state=\"%s\"} %llu\n",
+			state_names[i], (unsigned long long)count,
+			state_names[i], hist->sum_ns / 1e9,
+			state_names[i], (unsigned long long)count);
+	}
+}
+
+struct response *metrics_response(void)
+{
+	struct response *resp;
+	struct metrics sum;
+	char *body = NULL;
+	size_t len = 0;
+	unsigned int i;
+	FILE *f;
+
+	metrics_sum(&sum);
+
+	f = open_memstream(&body, &len);
+	if (f == NULL)
+		return NULL;
+
+	fprintf(f, "# HELP aws_connections_active Connections open.\n"
+		"# TYPE aws_connections_active gauge\n"
+		"aws_connections_active %llu\n",
+		(unsigned long long)(sum.connections_opened - sum.connections_closed));
+	fprintf(f, "# HELP aws_connections_total Connections accepted.\n"
+		"# TYPE aws_connections_total counter\n"
+		"aws_connections_total %llu\n", (unsigned long long)sum.connections_opened);
+
+	fprintf(f, "# HELP aws_requests_total Requests replied to, by status code.\n"
+		"# TYPE aws_requests_total counter\n");
+	for (i = 0; i < METRICS_CODES; i++)
+		fprintf(f, "aws_requests_total{code=\"%s\"} %llu\n", code_names[i],
+			(unsigned long long)sum.requests[i]);
+
+	fprintf(f, "# HELP aws_sent_bytes_total Bytes sent, by where they come from.\n"
+		"# TYPE aws_sent_bytes_total counter\n");
+	for (i = 0; i < METRICS_SOURCES; i++)
+		fprintf(f, "aws_sent_bytes_total{source=\"%s\"} %llu\n", source_names[i],
+			(unsigned long long)sum.sent_bytes[i]);
+
+	fprintf(f, "# HELP aws_eagain_total Calls that would have blocked, by operation.\n"
+		"# TYPE aws_eagain_total counter\n");
+	for (i = 0; i < METRICS_OPS; i++)
+		fprintf(f, "aws_eagain_total{op=\"%s\"} %llu\n", op_names[i],
+			(unsigned long long)sum.eagain[i]);
+
+	metrics_write_histograms(f, &sum);
+
+	if (fclose(f) != 0) {
+		free(body);
+		return NULL;
+	}
+
+	resp = response_create(body, len, AWS_METRICS_CONTENT_TYPE);
+	free(body);
+	return resp;
+}
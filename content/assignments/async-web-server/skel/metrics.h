@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef METRICS_H_
+#define METRICS_H_	1
+
+#include <stdint.h>
+
+#include "aws.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Server metrics, served in the Prometheus text format on AWS_METRICS_PATH.
+ * Every worker counts in its own metrics, with plain stores, and times the
+ * states of its connections with one clock read per event batch; a scrape
+ * adds up the metrics of all workers.
+ */
+
+/* Where the bytes sent come from */
+enum metrics_source {
+	METRICS_SOURCE_HEADER,		/* reply headers and 404s */
+	METRICS_SOURCE_SENDFILE,	/* static files */
+	METRICS_SOURCE_ASYNC,		/* dynamic files read asynchronously */
+	METRICS_SOURCE_SPLICE,		/* dynamic files spliced */
+	METRICS_SOURCE_CACHE,		/* cached replies and metrics */
+	METRICS_SOURCES
+};
+
+/* Calls that would have blocked */
+enum metrics_op {
+	METRICS_OP_RECV,
+	METRICS_OP_SEND,
+	METRICS_OP_SENDFILE,
+	METRICS_OP_SPLICE,
+	METRICS_OPS
+};
+
+enum metrics_code {
+	METRICS_CODE_200,
+	METRICS_CODE_404,
+	METRICS_CODES
+};
+
+/* Upper bounds of the dwell time buckets, 10 us to 10 s, then +Inf */
+#define METRICS_BUCKETS		13
+
+struct metrics_histogram {
+	uint64_t buckets[METRICS_BUCKETS + 1];
+	uint64_t sum_ns;
+};
+
+struct metrics {
+	uint64_t connections_opened;
+	uint64_t connections_closed;
+	uint64_t requests[METRICS_CODES];
+	uint64_t sent_bytes[METRICS_SOURCES];
+	uint64_t eagain[METRICS_OPS];
+	struct metrics_histogram dwell[STATE_NO_STATE];
+
+	struct metrics *next;	/* of another worker */
+};
+
+/* Metrics of the calling worker, and the time its current event batch started */
+extern __thread struct metrics *worker_metrics;
+extern __thread uint64_t metrics_now_ns;
+
+/* Only their worker writes its metrics; scrapes by other workers read them. */
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Set up the metrics of the calling worker */
+int metrics_init(void);
+
+/* Start a new event batch */
+void metrics_tick(void);
+
+/* Account ns spent in a state the connection just left */
+void metrics_dwell(enum connection_state state, uint64_t ns);
+
+/* Current metrics of all workers, as a reply to send; NULL on failure */
+struct response *metrics_response(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aws.h"
+#include "fd_cache.h"
+#include "response_cache.h"
+
+struct response_cache {
+	size_t max_bytes, bytes;
+	unsigned int max_entries, entries;
+	size_t max_body;
+
+	/* most recently used first */
+	struct response *lru_head, *lru_tail;
+};
+
+/* The cache the hook of each worker's files refers to */
+static __thread struct response_cache *drop_cache;
+
+static void lru_unlink(struct response_cache *cache, struct response *resp)
+{
+	if (resp->lru_prev != NULL)
+		resp->lru_prev->lru_next = resp->lru_next;
+	else
+		cache->lru_head = resp->lru_next;
+	if (resp->lru_next != NULL)
+		resp->lru_next->lru_prev = resp->lru_prev;
+	else
+		cache->lru_tail = resp->lru_prev;
+	resp->lru_prev = NULL;
+	resp->lru_next = NULL;
+}
+
+static void lru_push_front(struct response_cache *cache, struct response *resp)
+{
+	resp->lru_prev = NULL;
+	resp->lru_next = cache->lru_head;
+	if (cache->lru_head != NULL)
+		cache->lru_head->lru_prev = resp;
+	else
+		cache->lru_tail = resp;
+	cache->lru_head = resp;
+}
+
+/* Take a reply out of the cache; it is freed when its last user is done. */
+static void response_drop(struct response_cache *cache, struct response *resp)
+{
+	lru_unlink(cache, resp);
+	resp->file->data = NULL;
+	resp->file = NULL;
+	resp->cached = 0;
+	cache->bytes -= resp->size;
+	cache->entries--;
+
+	if (resp->refs == 0)
+		free(resp);
+}
+
+/* drop_data hook: the file of a reply was taken out of the file cache */
+static void drop_file_data(void *data)
+{
+	response_drop(drop_cache, data);
+}
+
+struct response_cache *response_cache_create(struct fd_cache *files, size_t max_bytes,
+					     unsigned int max_entries, size_t max_body)
+{
+	struct response_cache *cache = calloc(1, sizeof(*cache));
+
+	if (cache == NULL)
+		return NULL;
+
+	cache->max_bytes = max_bytes;
+	cache->max_entries = max_entries;
+	cache->max_body = max_body;
+
+	drop_cache = cache;
+	fd_cache_set_drop_data(files, drop_file_data);
+
+	return cache;
+}
+
+struct response *response_cache_get(struct response_cache *cache,
+				    struct fd_cache_entry *file)
+{
+	struct response *resp = file->data;
+
+	if (resp == NULL)
+		return NULL;
+
+	lru_unlink(cache, resp);
+	lru_push_front(cache, resp);
+	resp->refs++;
+	return resp;
+}
+
+/* Size of a reply of len bytes, with its headers */
+static size_t response_size(size_t len)
+{
+	return sizeof(struct response) + 2 * AWS_REPLY_HEADER_MAX + len;
+}
+
+struct response *response_create(const char *body, size_t len, const char *content_type)
+{
+	struct response *resp = malloc(response_size(len));
+	char *p;
+	int i;
+
+	if (resp == NULL)
+		return NULL;
+	memset(resp, 0, sizeof(*resp));
+
+	p = (char *)(resp + 1);
+	for (i = 0; i < 2; i++) {
+		resp->header[i] = p;
+		resp->header_len[i] = aws_format_reply_header(p, AWS_REPLY_HEADER_MAX, len, i,
+							      content_type);
+		if (resp->header_len[i] >= AWS_REPLY_HEADER_MAX) {
+			free(resp);
+			return NULL;
+		}
+		p += AWS_REPLY_HEADER_MAX;
+	}
+	memcpy(p, body, len);
+	resp->body = p;
+	resp->body_len = len;
+	resp->size = response_size(len);
+	resp->refs = 1;
+
+	return resp;
+}
+
+void response_cache_add(struct response_cache *cache, struct fd_cache_entry *file,
+			const char *body, size_t len)
+{
+	struct response *resp;
+	size_t size;
+
+	/* Only files whose changes are heard of */
+	if (!file->cached || file->data != NULL || len > cache->max_body ||
+	    cache->max_entries == 0)
+		return;
+
+	size = response_size(len);
+	if (size > cache->max_bytes)
+		return;
+
+	while (cache->lru_tail != NULL &&
+	       (cache->bytes + size > cache->max_bytes || cache->entries == cache->max_entries))
+		response_drop(cache, cache->lru_tail);
+
+	resp = response_create(body, len, NULL);
+	if (resp == NULL)
+		return;
+
+	/* Users take their own references. */
+	resp->refs = 0;
+	resp->cached = 1;
+	resp->file = file;
+	file->data = resp;
+	lru_push_front(cache, resp);
+	cache->bytes += size;
+	cache->entries++;
+}
+
+void response_put(struct response *resp)
+{
+	if (--resp->refs == 0 && !resp->cached)
+		free(resp);
+}
+
+int response_iov(const struct response *resp, int keep_alive, size_t pos,
+		 struct iovec iov[2])
+{
+	size_t header_len = resp->header_len[keep_alive != 0];
+	int n = 0;
+
+	if (pos < header_len) {
+		iov[n].iov_base = (char *)resp->header[keep_alive != 0] + pos;
+		iov[n].iov_len = header_len - pos;
+		n++;
+		pos = header_len;
+	}
+	if (pos - header_len < resp->body_len) {
+		iov[n].iov_base = (char *)resp->body + (pos - header_len);
+		iov[n].iov_len = resp->body_len - (pos - header_len);
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef RESPONSE_CACHE_H_
+#define RESPONSE_CACHE_H_	1
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fd_cache;
+struct fd_cache_entry;
+
+/*
+ * Bounded in-memory cache of whole 200 replies of small files: the body,
+ * next to its prebuilt headers (one with "Connection: keep-alive", one with
+ * "Connection: close"). A reply is attached to the file's fd_cache entry,
+ * so it goes away with it when the file changes. Least recently used
+ * replies are evicted to stay within the byte and entry caps.
+ */
+
+struct response {
+	const char *header[2];		/* indexed by keep-alive */
+	size_t header_len[2];
+	const char *body;
+	size_t body_len;
+	size_t size;			/* bytes accounted for */
+
+	unsigned int refs;		/* users, the cache itself excluded */
+	int cached;
+	struct fd_cache_entry *file;
+	struct response *lru_prev, *lru_next;
+};
+
+struct response_cache;
+
+/*
+ * A cache of at most max_entries replies and max_bytes bytes, with bodies of
+ * at most max_body bytes; it takes over the drop_data hook of files.
+ */
+struct response_cache *response_cache_create(struct fd_cache *files, size_t max_bytes,
+					     unsigned int max_entries, size_t max_body);
+
+/* Cached reply of a file, if any; release it with response_put() */
+struct response *response_cache_get(struct response_cache *cache,
+				    struct fd_cache_entry *file);
+
+/* Cache the reply of a file from its whole body, if it fits */
+void response_cache_add(struct response_cache *cache, struct fd_cache_entry *file,
+			const char *body, size_t len);
+
+/* A reply of body, of content_type if not NULL, not kept in any cache, with one user */
+struct response *response_create(const char *body, size_t len, const char *content_type);
+
+void response_put(struct response *resp);
+
+/* Fill iov with what is left of a reply from pos on; returns the count used */
+int response_iov(const struct response *resp, int keep_alive, size_t pos,
+		 struct iovec iov[2]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RESPONSE_CACHE_H_ */
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef POOL_H_
+#define POOL_H_		1
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Free list of objects of one size, for one thread. Objects put back are
+ * reused by the next pool_get(); beyond max_free of them, they are freed.
+ */
+struct pool {
+	size_t size;
+	unsigned int max_free;
+	unsigned int num_free;
+	void *free;		/* linked through the first word of the objects */
+};
+
+#define POOL_INIT(object_size, max)	{ .size = (object_size), .max_free = (max) }
+
+static inline void *pool_get(struct pool *pool)
+{
+	void *obj = pool->free;
+
+	if (obj == NULL)
+		return malloc(pool->size);
+
+	pool->free = *(void **)obj;
+	pool->num_free--;
+	return obj;
+}
+
+static inline void pool_put(struct pool *pool, void *obj)
+{
+	if (pool->num_free == pool->max_free) {
+		free(obj);
+		return;
+	}
+
+	*(void **)obj = pool->free;
+	pool->free = obj;
+	pool->num_free++;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POOL_H_ */
@@ -62,7 +62,7 @@ int tcp_close_connection(int sockfd)
  * Create a server socket.
  */
 
-int tcp_create_listener(unsigned short port, int backlog)
+static int create_listener(unsigned short port, int backlog, int reuseport)
 {
 	struct sockaddr_in address;
 	int listenfd;
@@ -77,6 +77,12 @@ int tcp_create_listener(unsigned short port, int backlog)
 				&sock_opt, sizeof(int));
 	DIE(rc < 0, "setsockopt");
 
+	if (reuseport) {
+		rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+					&sock_opt, sizeof(int));
+		DIE(rc < 0, "setsockopt");
+	}
+
 	memset(&address, 0, sizeof(address));
 	address.sin_family = AF_INET;
 	address.sin_port = htons(port);
@@ -91,6 +97,21 @@ int tcp_create_listener(unsigned short port, int backlog)
 	return listenfd;
 }
 
+int tcp_create_listener(unsigned short port, int backlog)
+{
+	return create_listener(port, backlog, 0);
+}
+
+/*
+ * Create one of several server sockets bound to the same port; the kernel
+ * balances incoming connections between them.
+ */
+
+int tcp_create_listener_reuseport(unsigned short port, int backlog)
+{
+	return create_listener(port, backlog, 1);
+}
+
 /*
  * Use getpeername(2) to extract remote peer address. Fill buffer with
  * address format IP_address:port (e.g. 192.168.0.1:22).
@@ -166,10 +166,47 @@ static inline int w_epoll_remove_ptr(int epollfd, int fd, void *ptr)
 	return epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev);
 }
 
+/*
+ * Edge-triggered registrations: readiness is only reported when it changes,
+ * so the caller must read / write until EAGAIN before waiting again.
+ */
+static inline int w_epoll_add_ptr_in_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static inline int w_epoll_add_ptr_inout_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
 static inline int w_epoll_wait_infinite(int epollfd, struct epoll_event *rev)
 {
 	return epoll_wait(epollfd, rev, 1, EPOLL_TIMEOUT_INFINITE);
 }
+
+/* Wait for up to maxevents events at once */
+static inline int w_epoll_wait_batch(int epollfd, struct epoll_event *revs, int maxevents)
+{
+	return epoll_wait(epollfd, revs, maxevents, EPOLL_TIMEOUT_INFINITE);
+}
+
+/* Same, returning 0 if none came within timeout milliseconds */
+static inline int w_epoll_wait_batch_timeout(int epollfd, struct epoll_event *revs,
+					     int maxevents, int timeout)
+{
+	return epoll_wait(epollfd, revs, maxevents, timeout);
+}
 #ifdef __cplusplus
 }
 #endif
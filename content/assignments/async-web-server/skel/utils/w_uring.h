@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef W_URING_H_
+#define W_URING_H_	1
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls, so no liburing
+ * is needed. One thread owns a ring: it fills submission queue entries with
+ * w_uring_get_sqe(), submits them all and waits for completions with a
+ * single w_uring_submit_and_wait(), then walks the completion queue with
+ * w_uring_peek_cqe() / w_uring_cqe_seen().
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct w_uring {
+	int fd;
+	unsigned int features;
+
+	/* submission queue, shared with the kernel */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_local_tail;	/* entries filled, not yet published */
+	unsigned int sq_submitted;	/* entries published to the kernel */
+
+	/* completion queue, shared with the kernel */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/* Set up a ring with entries submission slots and cq_entries completion slots */
+static inline int w_uring_setup(struct w_uring *ring, unsigned int entries,
+				unsigned int cq_entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->features = p.features;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->sq_submitted = ring->sq_local_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+err_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+err_close:
+	close(ring->fd);
+	return -1;
+}
+
+/* Register buffers for IORING_OP_READ_FIXED / IORING_OP_WRITE_FIXED, by index */
+static inline int w_uring_register_buffers(struct w_uring *ring,
+					   const struct iovec *iov, unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, nr);
+}
+
+/* Publish the filled entries, then enter the kernel to submit them and wait */
+static inline int w_uring_submit_and_wait(struct w_uring *ring, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int rc;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sq_local_tail - ring->sq_submitted;
+
+	do {
+		rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+			     wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0)
+		return -1;
+
+	ring->sq_submitted += rc;
+	return rc;
+}
+
+/* Wait for wait_nr completions, without submitting anything */
+static inline int w_uring_wait(struct w_uring *ring, unsigned int wait_nr)
+{
+	int rc;
+
+	do {
+		rc = syscall(__NR_io_uring_enter, ring->fd, 0, wait_nr,
+			     IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+
+	return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Make room for nr submission entries, submitting the pending ones first if
+ * fewer are free, so that the next nr w_uring_get_sqe() calls don't submit
+ * (e.g. in the middle of a chain of linked entries). Returns -1 with errno
+ * set if the kernel can't take enough of them; EBUSY and EAGAIN mean it may
+ * once completions are reaped.
+ */
+static inline int w_uring_reserve(struct w_uring *ring, unsigned int nr)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sq_local_tail - head + nr <= ring->sq_mask + 1)
+		return 0;
+
+	if (w_uring_submit_and_wait(ring, 0) < 0)
+		return -1;
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head + nr > ring->sq_mask + 1) {
+		/* The kernel took only some of the entries. */
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Next free submission entry, cleared; submits the pending entries first if
+ * the queue is full. Returns NULL if the kernel can't take any.
+ */
+static inline struct io_uring_sqe *w_uring_get_sqe(struct w_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (w_uring_reserve(ring, 1) < 0)
+		return NULL;
+
+	idx = ring->sq_local_tail & ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* Oldest unseen completion, NULL if there is none */
+static inline struct io_uring_cqe *w_uring_peek_cqe(struct w_uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Hand the completion returned by w_uring_peek_cqe() back to the kernel */
+static inline void w_uring_cqe_seen(struct w_uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void w_uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+				   const void *addr, unsigned int len, __u64 offset)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->len = len;
+	sqe->off = offset;
+}
+
+static inline void w_uring_prep_accept(struct io_uring_sqe *sqe, int fd, int flags)
+{
+	w_uring_prep_rw(sqe, IORING_OP_ACCEPT, fd, NULL, 0, 0);
+	sqe->accept_flags = flags;
+}
+
+static inline void w_uring_prep_recv(struct io_uring_sqe *sqe, int fd,
+				     void *buf, unsigned int len, int flags)
+{
+	w_uring_prep_rw(sqe, IORING_OP_RECV, fd, buf, len, 0);
+	sqe->msg_flags = flags;
+}
+
+static inline void w_uring_prep_send(struct io_uring_sqe *sqe, int fd,
+				     const void *buf, unsigned int len, int flags)
+{
+	w_uring_prep_rw(sqe, IORING_OP_SEND, fd, buf, len, 0);
+	sqe->msg_flags = flags;
+}
+
+static inline void w_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+					const struct msghdr *msg, int flags)
+{
+	w_uring_prep_rw(sqe, IORING_OP_SENDMSG, fd, msg, 1, 0);
+	sqe->msg_flags = flags;
+}
+
+static inline void w_uring_prep_read(struct io_uring_sqe *sqe, int fd,
+				     void *buf, unsigned int len, __u64 offset)
+{
+	w_uring_prep_rw(sqe, IORING_OP_READ, fd, buf, len, offset);
+}
+
+/* One-shot poll for events (POLLIN, ...) on fd */
+static inline void w_uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned int events)
+{
+	w_uring_prep_rw(sqe, IORING_OP_POLL_ADD, fd, NULL, 0, 0);
+	sqe->poll32_events = events;
+}
+
+/* Complete with -ETIME once ts has passed; ts must stay valid until then */
+static inline void w_uring_prep_timeout(struct io_uring_sqe *sqe, const struct __kernel_timespec *ts)
+{
+	w_uring_prep_rw(sqe, IORING_OP_TIMEOUT, -1, ts, 1, 0);
+}
+
+/* buf must lie within the registered buffer buf_index */
+static inline void w_uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+					   unsigned int len, __u64 offset, int buf_index)
+{
+	w_uring_prep_rw(sqe, IORING_OP_READ_FIXED, fd, buf, len, offset);
+	sqe->buf_index = buf_index;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* W_URING_H_ */
@@ -0,0 +1,580 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Load generator for aws, in the spirit of wrk: threads with an epoll
+ * instance each keep their share of the connections busy for a while, one
+ * request in flight per connection. The connections of every thread are
+ * spread over the paths, so static and dynamic files can be measured side
+ * by side. Requests per second and latency percentiles are reported for
+ * every path; the exit status is nonzero on errors or when a threshold is
+ * missed, so that runs against localhost can gate regressions.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_PORT		8888
+#define BENCH_MAX_PATHS		16
+#define BENCH_HEADER_MAX	4096
+#define BENCH_EPOLL_BATCH	64
+
+/*
+ * Latency histogram, in microseconds: 16 linear buckets per power of two,
+ * so a percentile is off by at most 1/16 of its value.
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+struct path_stats {
+	struct histogram latency;
+	uint64_t bytes;
+	uint64_t errors;
+};
+
+struct bench_thread;
+
+struct bench_conn {
+	struct bench_thread *thread;
+	int fd;
+	unsigned int path;
+
+	size_t req_pos;
+	/* reply header, then the count of the body still to receive */
+	char header[BENCH_HEADER_MAX];
+	size_t header_len;
+	int in_body;
+	size_t body_left;
+	int status;
+	int keep_alive;		/* the server keeps the connection open */
+	uint64_t start_ns;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	int epollfd;
+	unsigned int num_conns;
+	struct bench_conn *conns;
+	struct path_stats stats[BENCH_MAX_PATHS];
+};
+
+/* Settings, from the command line */
+static struct sockaddr_in server;
+static const char *paths[BENCH_MAX_PATHS];
+static char *requests[BENCH_MAX_PATHS];
+static size_t request_lens[BENCH_MAX_PATHS];
+static unsigned int num_paths;
+static int use_keep_alive = 1;
+static uint64_t deadline_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t us)
+{
+	unsigned int msb;
+
+	if (us < HIST_SUB)
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	       ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Highest value of a bucket */
+static uint64_t hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB)
+		return index;
+
+	shift = index / HIST_SUB - 1;
+	return (((uint64_t)HIST_SUB + index % HIST_SUB) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_add(struct histogram *hist, uint64_t us)
+{
+	hist->count[hist_index(us)]++;
+	hist->total++;
+	if (us > hist->max)
+		hist->max = us;
+}
+
+static void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->count[i] += src->count[i];
+	dst->total += src->total;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* Value below which a fraction q of the samples are */
+static uint64_t hist_percentile(const struct histogram *hist, double q)
+{
+	uint64_t rank = (uint64_t)(q * hist->total), seen = 0;
+	unsigned int i;
+
+	if (hist->total == 0)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->count[i];
+		if (seen > rank)
+			break;
+	}
+	return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+}
+
+static int conn_want(struct bench_conn *conn, int op, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = conn };
+
+	return epoll_ctl(conn->thread->epollfd, op, conn->fd, &ev);
+}
+
+static void conn_start_request(struct bench_conn *conn)
+{
+	conn->req_pos = 0;
+	conn->header_len = 0;
+	conn->in_body = 0;
+	conn->body_left = 0;
+	conn->status = 0;
+	conn->keep_alive = 0;
+	conn->start_ns = now_ns();
+}
+
+static int conn_open(struct bench_conn *conn)
+{
+	int one = 1;
+
+	conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (conn->fd < 0)
+		return -1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(conn->fd, (struct sockaddr *)&server, sizeof(server)) < 0 &&
+	    errno != EINPROGRESS) {
+		close(conn->fd);
+		conn->fd = -1;
+		return -1;
+	}
+
+	/* Timed from the connect: without keep-alive, it is part of every request. */
+	conn_start_request(conn);
+	return conn_want(conn, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+static void conn_close(struct bench_conn *conn)
+{
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+}
+
+/* Open a new connection for the next request; give up on the slot on failure */
+static void conn_reopen(struct bench_conn *conn)
+{
+	conn_close(conn);
+	if (now_ns() < deadline_ns && conn_open(conn) < 0) {
+		perror("connect");
+		conn_close(conn);
+	}
+}
+
+static void conn_fail(struct bench_conn *conn)
+{
+	conn->thread->stats[conn->path].errors++;
+	conn_reopen(conn);
+}
+
+static void conn_send(struct bench_conn *conn)
+{
+	const char *req = requests[conn->path];
+	size_t len = request_lens[conn->path];
+
+	while (conn->req_pos < len) {
+		ssize_t n = send(conn->fd, req + conn->req_pos, len - conn->req_pos,
+				 MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			conn_fail(conn);
+			return;
+		}
+		conn->req_pos += n;
+	}
+
+	if (conn_want(conn, EPOLL_CTL_MOD, EPOLLIN) < 0)
+		conn_fail(conn);
+}
+
+/* Status, length and connection reuse of a complete reply header */
+static int conn_parse_header(struct bench_conn *conn, size_t len)
+{
+	char *line, *save = NULL;
+	int have_length = 0;
+
+	conn->header[len - 2] = '\0';
+	line = strtok_r(conn->header, "\r\n", &save);
+	if (line == NULL || sscanf(line, "HTTP/1.%*d %d", &conn->status) != 1)
+		return -1;
+	/* HTTP/1.1 replies keep the connection by default. */
+	conn->keep_alive = strncmp(line, "HTTP/1.1", 8) == 0;
+
+	while ((line = strtok_r(NULL, "\r\n", &save)) != NULL) {
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			conn->body_left = strtoull(line + 15, NULL, 10);
+			have_length = 1;
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			conn->keep_alive = strcasestr(line + 11, "close") == NULL;
+		}
+	}
+
+	return have_length ? 0 : -1;
+}
+
+static void conn_complete(struct bench_conn *conn)
+{
+	struct path_stats *stats = &conn->thread->stats[conn->path];
+
+	hist_add(&stats->latency, (now_ns() - conn->start_ns) / 1000);
+	if (conn->status != 200)
+		stats->errors++;
+
+	if (now_ns() >= deadline_ns) {
+		conn_close(conn);
+		return;
+	}
+	if (!use_keep_alive || !conn->keep_alive) {
+		conn_reopen(conn);
+		return;
+	}
+
+	conn_start_request(conn);
+	if (conn_want(conn, EPOLL_CTL_MOD, EPOLLOUT) < 0)
+		conn_fail(conn);
+	else
+		conn_send(conn);
+}
+
+static void conn_receive(struct bench_conn *conn)
+{
+	struct path_stats *stats = &conn->thread->stats[conn->path];
+	char body[65536];
+
+	while (1) {
+		char *buf = conn->in_body ? body : conn->header + conn->header_len;
+		size_t size = conn->in_body ? sizeof(body) :
+			      sizeof(conn->header) - 1 - conn->header_len;
+		ssize_t n;
+
+		/* Only what is left of this reply: the next one is not asked for yet. */
+		if (conn->in_body && size > conn->body_left)
+			size = conn->body_left;
+
+		n = recv(conn->fd, buf, size, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			conn_fail(conn);
+			return;
+		}
+		if (n == 0) {
+			conn_fail(conn);
+			return;
+		}
+		stats->bytes += n;
+
+		if (!conn->in_body) {
+			char *end;
+			size_t header_len;
+
+			conn->header_len += n;
+			conn->header[conn->header_len] = '\0';
+			end = strstr(conn->header, "\r\n\r\n");
+			if (end == NULL) {
+				if (conn->header_len == sizeof(conn->header) - 1) {
+					conn_fail(conn);
+					return;
+				}
+				continue;
+			}
+
+			header_len = end + 4 - conn->header;
+			n = conn->header_len - header_len;
+			if (conn_parse_header(conn, header_len) < 0 || (size_t)n > conn->body_left) {
+				conn_fail(conn);
+				return;
+			}
+			conn->in_body = 1;
+		}
+
+		conn->body_left -= n;
+		if (conn->body_left == 0) {
+			conn_complete(conn);
+			return;
+		}
+	}
+}
+
+static void *bench_thread_run(void *arg)
+{
+	struct bench_thread *thread = arg;
+	unsigned int i, open = 0;
+
+	for (i = 0; i < thread->num_conns; i++) {
+		if (conn_open(&thread->conns[i]) < 0) {
+			perror("connect");
+			conn_close(&thread->conns[i]);
+		}
+	}
+
+	while (1) {
+		struct epoll_event events[BENCH_EPOLL_BATCH];
+		uint64_t now = now_ns();
+		int n, timeout;
+
+		/* Connections close once their reply after the deadline is in. */
+		for (i = 0, open = 0; i < thread->num_conns; i++)
+			open += thread->conns[i].fd >= 0;
+		if (open == 0)
+			break;
+		/* Replies still missing a second after the deadline are dropped. */
+		if (now >= deadline_ns + 1000000000ULL)
+			break;
+
+		timeout = now < deadline_ns ? (deadline_ns - now) / 1000000 + 1 : 100;
+		n = epoll_wait(thread->epollfd, events, BENCH_EPOLL_BATCH, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < (unsigned int)n; i++) {
+			struct bench_conn *conn = events[i].data.ptr;
+
+			if (conn->fd < 0)
+				continue;
+			if (conn->req_pos < request_lens[conn->path])
+				conn_send(conn);
+			else
+				conn_receive(conn);
+		}
+	}
+
+	for (i = 0; i < thread->num_conns; i++)
+		conn_close(&thread->conns[i]);
+	return NULL;
+}
+
+static void print_stats(const char *name, const struct path_stats *stats, double seconds)
+{
+	const struct histogram *hist = &stats->latency;
+
+	printf("%-32s %10llu %10.1f %8.1f %8llu %8llu %8llu %8llu %7llu\n", name,
+	       (unsigned long long)hist->total, hist->total / seconds,
+	       stats->bytes / seconds / (1024 * 1024),
+	       (unsigned long long)hist_percentile(hist, 0.5),
+	       (unsigned long long)hist_percentile(hist, 0.99),
+	       (unsigned long long)hist_percentile(hist, 0.999),
+	       (unsigned long long)hist->max, (unsigned long long)stats->errors);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-c connections] [-t threads] [-d seconds] [-a address]\n"
+		"        [-p port] [-C] [-r req/s] [-l p99] path...\n"
+		"  -c  connections, spread over the paths (default 16)\n"
+		"  -t  threads, each with its own epoll instance (default 1)\n"
+		"  -d  duration of the run in seconds (default 10)\n"
+		"  -a  IPv4 address of the server (default 127.0.0.1)\n"
+		"  -p  port of the server (default %d)\n"
+		"  -C  one request per connection, without keep-alive\n"
+		"  -r  fail if fewer requests per second are served, in total\n"
+		"  -l  fail if the 99th percentile latency of a path exceeds this, in us\n",
+		argv0, BENCH_PORT);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int num_conns = 16, num_threads = 1, duration = 10;
+	const char *address = "127.0.0.1";
+	int port = BENCH_PORT;
+	double min_rps = 0, seconds;
+	uint64_t max_p99 = 0, start;
+	struct bench_thread *threads;
+	struct path_stats total[BENCH_MAX_PATHS + 1];
+	int opt, rc, failed = 0;
+	unsigned int i, t;
+
+	while ((opt = getopt(argc, argv, "c:t:d:a:p:Cr:l:")) != -1) {
+		switch (opt) {
+		case 'c':
+			num_conns = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'C':
+			use_keep_alive = 0;
+			break;
+		case 'r':
+			min_rps = atof(optarg);
+			break;
+		case 'l':
+			max_p99 = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc || argc - optind > BENCH_MAX_PATHS ||
+	    num_conns == 0 || num_threads == 0 || duration == 0)
+		usage(argv[0]);
+	if (num_threads > num_conns)
+		num_threads = num_conns;
+
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &server.sin_addr) != 1)
+		usage(argv[0]);
+
+	for (num_paths = 0; optind < argc; optind++, num_paths++) {
+		paths[num_paths] = argv[optind];
+		rc = asprintf(&requests[num_paths], "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+			      paths[num_paths], address,
+			      use_keep_alive ? "" : "Connection: close\r\n");
+		if (rc < 0) {
+			perror("asprintf");
+			return EXIT_FAILURE;
+		}
+		request_lens[num_paths] = rc;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (threads == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	deadline_ns = start + (uint64_t)duration * 1000000000;
+
+	/* Every thread requests every path: the client's own load is spread evenly. */
+	for (t = 0; t < num_threads; t++) {
+		struct bench_thread *thread = &threads[t];
+
+		thread->num_conns = num_conns / num_threads + (t < num_conns % num_threads);
+		thread->conns = calloc(thread->num_conns, sizeof(*thread->conns));
+		thread->epollfd = epoll_create1(0);
+		if (thread->conns == NULL || thread->epollfd < 0) {
+			perror("thread setup");
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < thread->num_conns; i++) {
+			thread->conns[i].thread = thread;
+			thread->conns[i].fd = -1;
+			thread->conns[i].path = (i + t) % num_paths;
+		}
+
+		rc = pthread_create(&thread->thread, NULL, bench_thread_run, thread);
+		if (rc != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+			return EXIT_FAILURE;
+		}
+	}
+
+	memset(total, 0, sizeof(total));
+	for (t = 0; t < num_threads; t++) {
+		pthread_join(threads[t].thread, NULL);
+		for (i = 0; i < num_paths; i++) {
+			struct path_stats *stats = &threads[t].stats[i];
+
+			hist_merge(&total[i].latency, &stats->latency);
+			total[i].bytes += stats->bytes;
+			total[i].errors += stats->errors;
+			hist_merge(&total[num_paths].latency, &stats->latency);
+			total[num_paths].bytes += stats->bytes;
+			total[num_paths].errors += stats->errors;
+		}
+	}
+	seconds = (now_ns() - start) / 1e9;
+
+	printf("%u connections, %u threads, %.1f s, %s\n", num_conns, num_threads, seconds,
+	       use_keep_alive ? "keep-alive" : "one request per connection");
+	printf("%-32s %10s %10s %8s %8s %8s %8s %8s %7s\n", "path", "requests", "req/s",
+	       "MiB/s", "p50(us)", "p99(us)", "p999(us)", "max(us)", "errors");
+	for (i = 0; i < num_paths; i++)
+		print_stats(paths[i], &total[i], seconds);
+	if (num_paths > 1)
+		print_stats("total", &total[num_paths], seconds);
+	fflush(stdout);
+
+	for (i = 0; i < num_paths; i++) {
+		if (max_p99 && hist_percentile(&total[i].latency, 0.99) > max_p99) {
+			fprintf(stderr, "%s: p99 latency above %llu us\n", paths[i],
+				(unsigned long long)max_p99);
+			failed = 1;
+		}
+	}
+
+	if (total[num_paths].errors > 0) {
+		fprintf(stderr, "%llu failed requests\n",
+			(unsigned long long)total[num_paths].errors);
+		failed = 1;
+	}
+	if (total[num_paths].latency.total / seconds < min_rps) {
+		fprintf(stderr, "fewer than %.1f requests per second\n", min_rps);
+		failed = 1;
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
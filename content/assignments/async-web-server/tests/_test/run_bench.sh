@@ -0,0 +1,38 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-3-Clause
+
+# Start the server in a scratch document root and load it with aws_bench,
+# a small and a large file of each kind. Extra arguments (thresholds, -C,
+# ...) go to aws_bench, AWS_ARGS to the server.
+
+exec_name="$(realpath ./aws)"
+bench_name="$(realpath ./_test/aws_bench)"
+aws_listen_port=8888
+
+BENCH_CONNECTIONS=${BENCH_CONNECTIONS:-64}
+BENCH_THREADS=${BENCH_THREADS:-2}
+BENCH_DURATION=${BENCH_DURATION:-5}
+
+root=$(mktemp -d)
+trap 'kill $exec_pid 2> /dev/null; wait $exec_pid 2> /dev/null; rm -rf "$root"' EXIT
+
+mkdir "$root/static" "$root/dynamic"
+for kind in static dynamic; do
+	dd if=/dev/urandom of="$root/$kind/small.dat" bs=1K count=4 status=none
+	dd if=/dev/urandom of="$root/$kind/large.dat" bs=1M count=4 status=none
+done
+
+cd "$root" || exit 1
+$exec_name $AWS_ARGS > /dev/null 2>&1 &
+exec_pid=$!
+
+# Wait for the server to listen.
+for ((i = 0; i < 50; i++)); do
+	if (echo > /dev/tcp/127.0.0.1/$aws_listen_port) 2> /dev/null; then
+		break
+	fi
+	sleep 0.1
+done
+
+$bench_name -c "$BENCH_CONNECTIONS" -t "$BENCH_THREADS" -d "$BENCH_DURATION" "$@" \
+	/static/small.dat /dynamic/small.dat /static/large.dat /dynamic/large.dat
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""Scaling benchmark: run ./serial and ./parallel on graphs and report
+load and traversal times, speedup over serial and peak RSS.
+
+Graphs can be generated with ./graph_gen; `make bench` generates and runs
+a default set.
+"""
+
+import argparse
+import csv
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+TIME_RE = re.compile(r"^(\w+): ([0-9.]+) ms$", re.M)
+
+
+def default_threads():
+    threads, n = [], 1
+    while n < os.cpu_count():
+        threads.append(n)
+        n *= 2
+    return threads + [os.cpu_count()]
+
+
+def measure(cmd, repeat):
+    """Best of repeat runs, by traversal time."""
+    best = None
+    for _ in range(repeat):
+        # communicate() would reap the child, losing its rusage, so stderr
+        # goes to a file and stdout is the only pipe read before wait4
+        with tempfile.TemporaryFile("w+") as errfile:
+            proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=errfile, text=True)
+            with proc.stdout:
+                out = proc.stdout.read()
+            _, status, usage = os.wait4(proc.pid, 0)
+            errfile.seek(0)
+            err = errfile.read()
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        if proc.returncode != 0:
+            sys.exit("{} failed:\n{}{}".format(" ".join(cmd), out, err))
+        times = {k: float(v) for k, v in TIME_RE.findall(err)}
+        result = {
+            "sum": out.strip(),
+            "load": times["load"],
+            "traverse": times["traverse"],
+            "rss": usage.ru_maxrss / 1024,
+        }
+        if best is None or result["traverse"] < best["traverse"]:
+            best = result
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("graphs", nargs="+", help="graph files, text or binary")
+    parser.add_argument("-t", "--threads", type=lambda s: [int(x) for x in s.split(",")],
+                        default=default_threads(), help="comma separated thread counts")
+    parser.add_argument("-m", "--modes", default="task,bfs",
+                        help="comma separated traversal modes of ./parallel")
+    parser.add_argument("-r", "--repeat", type=int, default=3, help="runs per point, best is kept")
+    parser.add_argument("--csv", help="also write the results to this CSV file")
+    parser.add_argument("-a", "--args", default="",
+                        help="extra ./parallel options, e.g. -a=-p")
+    args = parser.parse_args()
+    extra = args.args.split()
+
+    rows = []
+    header = "{:<24} {:<6} {:>7} {:>10} {:>12} {:>8} {:>9}".format(
+        "graph", "mode", "threads", "load ms", "traverse ms", "speedup", "RSS MiB")
+    print(header)
+    print("-" * len(header))
+    for graph in args.graphs:
+        name = os.path.basename(graph)
+        serial = measure(["./serial", "-v", graph], args.repeat)
+        points = [("serial", 1, serial)]
+        for mode in args.modes.split(","):
+            for threads in args.threads:
+                cmd = ["./parallel", "-v", "-m", mode, "-t", str(threads)] + extra + [graph]
+                result = measure(cmd, args.repeat)
+                if result["sum"] != serial["sum"]:
+                    sys.exit("{}: {} gives {}, serial gives {}".format(
+                        name, " ".join(cmd), result["sum"], serial["sum"]))
+                points.append((mode, threads, result))
+
+        for mode, threads, r in points:
+            speedup = serial["traverse"] / r["traverse"] if r["traverse"] > 0 else 0
+            print("{:<24} {:<6} {:>7} {:>10.1f} {:>12.1f} {:>8.2f} {:>9.1f}".format(
+                name, mode, threads, r["load"], r["traverse"], speedup, r["rss"]))
+            rows.append([name, mode, threads, r["load"], r["traverse"], speedup, r["rss"]])
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(["graph", "mode", "threads", "load_ms", "traverse_ms",
+                             "speedup", "rss_mib"])
+            writer.writerows(rows)
+
+
+if __name__ == "__main__":
+    main()
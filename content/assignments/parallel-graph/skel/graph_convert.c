@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "os_graph.h"
+
+/* Convert a graph file (text or binary) to the binary graph format */
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		printf("Usage: %s input_file output_file\n", argv[0]);
+		exit(1);
+	}
+
+	FILE *input_file = fopen(argv[1], "r");
+
+	if (input_file == NULL) {
+		printf("[Error] Can't open file\n");
+		return -1;
+	}
+
+	os_graph_t *graph = create_graph_from_file(input_file);
+
+	fclose(input_file);
+	if (graph == NULL) {
+		printf("[Error] Can't read the graph from file\n");
+		return -1;
+	}
+
+	FILE *output_file = fopen(argv[2], "w");
+
+	if (output_file == NULL) {
+		printf("[Error] Can't open output file\n");
+		return -1;
+	}
+
+	if (write_graph_binary(graph, output_file) < 0 || fclose(output_file) != 0) {
+		printf("[Error] Can't write the graph to file\n");
+		return -1;
+	}
+
+	destroy_graph(graph);
+	return 0;
+}
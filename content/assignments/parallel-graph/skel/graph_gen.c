@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "os_graph.h"
+
+/* R-MAT quadrant probabilities, as in the Graph500 generator */
+#define RMAT_A 0.57
+#define RMAT_B 0.19
+#define RMAT_C 0.19
+
+#define VALUE_RANGE 100		// Node values are in [-VALUE_RANGE, VALUE_RANGE]
+
+static uint64_t rngState;
+
+/* splitmix64 */
+static uint64_t rng_next(void)
+{
+	uint64_t z = (rngState += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n) */
+static unsigned int rng_below(unsigned int n)
+{
+	return (unsigned int) (((rng_next() >> 32) * n) >> 32);
+}
+
+/* Uniform in [0, 1) */
+static double rng_unit(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Erdos-Renyi G(n, m): m edges between uniformly chosen nodes */
+static void gen_er(unsigned int n, unsigned int m, os_edge_t *edges)
+{
+	for (unsigned int i = 0; i < m; ++i) {
+		edges[i].src = rng_below(n);
+		edges[i].dst = rng_below(n);
+	}
+}
+
+/*
+ * R-MAT (Chakrabarti et al., SDM 2004): every edge picks one quadrant of the
+ * adjacency matrix per bit of the node index, which gives a skewed, power-law
+ * like degree distribution. Edges past the last node are drawn again.
+ */
+static void gen_rmat(unsigned int n, unsigned int m, os_edge_t *edges)
+{
+	unsigned int scale = 0;
+
+	while ((1ULL << scale) < n)
+		scale++;
+
+	for (unsigned int i = 0; i < m; ++i) {
+		unsigned long long src, dst;
+
+		do {
+			src = 0;
+			dst = 0;
+			for (unsigned int bit = 0; bit < scale; ++bit) {
+				double r = rng_unit();
+
+				src <<= 1;
+				dst <<= 1;
+				if (r >= RMAT_A + RMAT_B + RMAT_C) {
+					src |= 1;
+					dst |= 1;
+				} else if (r >= RMAT_A + RMAT_B) {
+					src |= 1;
+				} else if (r >= RMAT_A) {
+					dst |= 1;
+				}
+			}
+		} while (src >= n || dst >= n);
+
+		edges[i].src = src;
+		edges[i].dst = dst;
+	}
+}
+
+/* Grid of w x h nodes, each linked to its right and bottom neighbours */
+static unsigned int gen_grid(unsigned int w, unsigned int h, os_edge_t *edges)
+{
+	unsigned int m = 0;
+
+	for (unsigned int y = 0; y < h; ++y)
+		for (unsigned int x = 0; x < w; ++x) {
+			unsigned int v = y * w + x;
+
+			if (x + 1 < w)
+				edges[m++] = (os_edge_t) { v, v + 1 };
+			if (y + 1 < h)
+				edges[m++] = (os_edge_t) { v, v + w };
+		}
+	return m;
+}
+
+static int write_text(FILE *f, unsigned int n, unsigned int m, int *values, os_edge_t *edges)
+{
+	unsigned int i;
+
+	fprintf(f, "%u %u\n", n, m);
+	for (i = 0; i < n; ++i)
+		fprintf(f, i + 1 < n ? "%d " : "%d", values[i]);
+	fputc('\n', f);
+	for (i = 0; i < m; ++i)
+		fprintf(f, "%d %d\n", edges[i].src, edges[i].dst);
+	return ferror(f) ? -1 : 0;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [-k rmat|er|grid] [-n nodes] [-e edges] [-s seed] [-b] output_file\n",
+	       argv0);
+	printf("  -e defaults to 8 edges per node; grids have 2 edges per node\n");
+	printf("  -b writes the binary format instead of text\n");
+	exit(1);
+}
+
+/* Generate a random graph with random node values */
+int main(int argc, char *argv[])
+{
+	const char *kind = "rmat";
+	unsigned long long n = 1 << 20, m = 0;
+	int binary = 0;
+	int opt;
+
+	rngState = 1;
+	while ((opt = getopt(argc, argv, "k:n:e:s:b")) != -1) {
+		switch (opt) {
+		case 'k':
+			kind = optarg;
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		case 'e':
+			m = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			rngState = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || n == 0 || n > INT32_MAX)
+		usage(argv[0]);
+
+	unsigned int w = 0, h = 0;
+
+	if (strcmp(kind, "grid") == 0) {
+		w = (unsigned int) sqrt((double) n);
+		h = (n + w - 1) / w;
+		n = (unsigned long long) w * h;
+		m = 2ULL * w * h - w - h;
+	} else if (strcmp(kind, "rmat") != 0 && strcmp(kind, "er") != 0) {
+		usage(argv[0]);
+	} else if (m == 0) {
+		m = 8 * n;
+	}
+	if (n > INT32_MAX || m > UINT32_MAX / 2)
+		usage(argv[0]);
+
+	int *values = malloc(n * sizeof(int));
+	os_edge_t *edges = malloc(m * sizeof(os_edge_t) + 1);
+
+	if (values == NULL || edges == NULL) {
+		printf("[Error] Not enough memory\n");
+		return -1;
+	}
+	for (unsigned int i = 0; i < n; ++i)
+		values[i] = (int) rng_below(2 * VALUE_RANGE + 1) - VALUE_RANGE;
+
+	if (w > 0)
+		gen_grid(w, h, edges);
+	else if (strcmp(kind, "rmat") == 0)
+		gen_rmat(n, m, edges);
+	else
+		gen_er(n, m, edges);
+
+	FILE *output_file = fopen(argv[optind], "w");
+
+	if (output_file == NULL) {
+		printf("[Error] Can't open output file\n");
+		return -1;
+	}
+
+	int r;
+
+	if (binary) {
+		os_graph_t *graph = create_graph_from_data(n, m, values, edges);
+
+		r = graph != NULL ? write_graph_binary(graph, output_file) : -1;
+		destroy_graph(graph);
+	} else {
+		r = write_text(output_file, n, m, values, edges);
+	}
+	if (r < 0 || fclose(output_file) != 0) {
+		printf("[Error] Can't write the graph to file\n");
+		return -1;
+	}
+
+	free(values);
+	free(edges);
+	return 0;
+}
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "os_bfs.h"
+#include "os_bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Switch to bottom-up when the frontier's edges exceed 1/ALPHA of the unexplored edges */
+#define BFS_ALPHA 14
+/* Switch back to top-down when the frontier has less than 1/BETA of the nodes */
+#define BFS_BETA 24
+#define BFS_CHUNKS_PER_THREAD 4
+/* Top-down levels with smaller frontiers are run by the caller, without the pool */
+#define BFS_SEQUENTIAL_FRONTIER 512
+
+struct bfs_state_t;
+
+/* Work of one task in a level; it fills its own part of the next frontier */
+typedef struct {
+	_Alignas(OS_CACHE_LINE) struct bfs_state_t *bfs;
+	unsigned int *next;
+	size_t nextLen, nextCap;
+	long long sum;			// Values of the nodes in next
+	size_t scout;			// Degrees of the nodes in next
+} bfs_chunk_t;
+
+typedef struct bfs_state_t {
+	os_graph_t *graph;
+	atomic_ulong *visited;
+	atomic_ulong *frontierBits;	// Current frontier, for bottom-up levels
+	unsigned int *frontier;
+	size_t frontierLen;
+
+	unsigned int nChunks;
+	size_t step;			// Items per chunk in the current level
+	bfs_chunk_t *chunks;
+} bfs_state_t;
+
+static void chunk_visit(bfs_chunk_t *c, unsigned int nodeIdx)
+{
+	if (c->nextLen == c->nextCap) {
+		c->nextCap = c->nextCap ? 2 * c->nextCap : 256;
+		c->next = realloc(c->next, c->nextCap * sizeof(unsigned int));
+		if (c->next == NULL) {
+			puts("[ERROR] [bfs] Not enough memory");
+			exit(-1);
+		}
+	}
+	c->next[c->nextLen++] = nodeIdx;
+	c->sum += os_graph_value(c->bfs->graph, nodeIdx);
+	c->scout += os_graph_degree(c->bfs->graph, nodeIdx);
+}
+
+/* Visit the unvisited neighbours of a slice of the frontier */
+static void top_down_chunk(bfs_chunk_t *c, size_t begin, size_t end)
+{
+	bfs_state_t *s = c->bfs;
+
+	for (size_t i = begin; i < end; ++i) {
+		unsigned int u = s->frontier[i];
+		unsigned int *neighbours = os_graph_neighbours(s->graph, u);
+		unsigned int degree = os_graph_degree(s->graph, u);
+
+		for (unsigned int j = 0; j < degree; ++j)
+			if (bitmap_claim(s->visited, neighbours[j]))
+				chunk_visit(c, neighbours[j]);
+	}
+}
+
+/* Visit the nodes of a slice that have a neighbour in the frontier */
+static void bottom_up_chunk(bfs_chunk_t *c, size_t begin, size_t end)
+{
+	bfs_state_t *s = c->bfs;
+
+	for (size_t v = begin; v < end; ++v) {
+		if (bitmap_test(s->visited, v))
+			continue;
+
+		unsigned int *neighbours = os_graph_neighbours(s->graph, v);
+		unsigned int degree = os_graph_degree(s->graph, v);
+
+		for (unsigned int j = 0; j < degree; ++j) {
+			if (bitmap_test(s->frontierBits, neighbours[j])) {
+				bitmap_set(s->visited, v);
+				chunk_visit(c, v);
+				break;
+			}
+		}
+	}
+}
+
+static void top_down_level(void *ctx, size_t begin, size_t end)
+{
+	bfs_state_t *s = ctx;
+
+	top_down_chunk(&s->chunks[begin / s->step], begin, end);
+}
+
+static void bottom_up_level(void *ctx, size_t begin, size_t end)
+{
+	bfs_state_t *s = ctx;
+
+	bottom_up_chunk(&s->chunks[begin / s->step], begin, end);
+}
+
+/* Run one level over n items, split in chunks; returns the chunks used */
+static unsigned int run_level(os_threadpool_t *tp, bfs_state_t *s, int bottomUp, size_t n)
+{
+	if (!bottomUp && n < BFS_SEQUENTIAL_FRONTIER) {
+		top_down_chunk(&s->chunks[0], 0, n);
+		return 1;
+	}
+
+	// Bottom-up slices start on a bitmap word, so chunks don't share words
+	s->step = (n + s->nChunks - 1) / s->nChunks;
+	if (bottomUp)
+		s->step = (s->step + BITS_PER_WORD - 1) / BITS_PER_WORD * BITS_PER_WORD;
+
+	tp_parallel_for(tp, 0, n, s->step, bottomUp ? bottom_up_level : top_down_level, s);
+	return (n + s->step - 1) / s->step;
+}
+
+static void clear_frontier_bits(void *ctx, size_t begin, size_t end)
+{
+	bfs_state_t *s = ctx;
+
+	memset(s->frontierBits + begin, 0, (end - begin) * sizeof(atomic_ulong));
+}
+
+static void set_frontier_bits(void *ctx, size_t begin, size_t end)
+{
+	bfs_state_t *s = ctx;
+
+	for (size_t i = begin; i < end; ++i)
+		bitmap_set(s->frontierBits, s->frontier[i]);
+}
+
+long long bfs_traverse(os_threadpool_t *tp, os_graph_t *graph)
+{
+	size_t n = graph->nCount;
+	size_t unexploredEdges = 2 * (size_t) graph->eCount;
+	long long sum = 0;
+	bfs_state_t s = {
+		.graph = graph,
+		.visited = bitmap_create(n),
+		.frontierBits = bitmap_create(n),
+		.frontier = malloc(n * sizeof(unsigned int) + 1),
+		.nChunks = tp->num_threads * BFS_CHUNKS_PER_THREAD,
+	};
+
+	s.chunks = aligned_alloc(OS_CACHE_LINE, s.nChunks * sizeof(bfs_chunk_t));
+	if (s.visited == NULL || s.frontierBits == NULL || s.frontier == NULL || s.chunks == NULL) {
+		puts("[ERROR] [bfs] Not enough memory");
+		exit(-1);
+	}
+	memset(s.chunks, 0, s.nChunks * sizeof(bfs_chunk_t));
+	for (unsigned int i = 0; i < s.nChunks; ++i)
+		s.chunks[i].bfs = &s;
+
+	// Start a traversal from the first node of every component
+	for (size_t root = 0; root < n; ++root) {
+		if (root % BITS_PER_WORD == 0 &&
+		    atomic_load_explicit(&s.visited[root / BITS_PER_WORD], memory_order_relaxed) == ~0UL) {
+			root += BITS_PER_WORD - 1;
+			continue;
+		}
+		if (!bitmap_claim(s.visited, root))
+			continue;
+
+		int bottomUp = 0;
+
+		sum += os_graph_value(graph, root);
+		unexploredEdges -= os_graph_degree(graph, root);
+		s.frontier[0] = root;
+		s.frontierLen = 1;
+
+		while (s.frontierLen > 0) {
+			unsigned int used = run_level(tp, &s, bottomUp, bottomUp ? n : s.frontierLen);
+			size_t scout = 0;
+
+			// Merge the chunks' next frontiers
+			s.frontierLen = 0;
+			for (unsigned int i = 0; i < used; ++i) {
+				bfs_chunk_t *c = &s.chunks[i];
+
+				memcpy(s.frontier + s.frontierLen, c->next, c->nextLen * sizeof(unsigned int));
+				s.frontierLen += c->nextLen;
+				sum += c->sum;
+				scout += c->scout;
+				c->nextLen = 0;
+				c->sum = 0;
+				c->scout = 0;
+			}
+			unexploredEdges -= scout;
+
+			if (!bottomUp && scout > unexploredEdges / BFS_ALPHA)
+				bottomUp = 1;
+			else if (bottomUp && s.frontierLen < n / BFS_BETA)
+				bottomUp = 0;
+
+			if (bottomUp) {
+				tp_parallel_for(tp, 0, n / BITS_PER_WORD + 1, 0, clear_frontier_bits, &s);
+				tp_parallel_for(tp, 0, s.frontierLen, 0, set_frontier_bits, &s);
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < s.nChunks; ++i)
+		free(s.chunks[i].next);
+	free(s.chunks);
+	free(s.frontier);
+	free(s.frontierBits);
+	free(s.visited);
+	return sum;
+}
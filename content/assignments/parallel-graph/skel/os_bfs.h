@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_BFS_H__
+#define __OS_BFS_H__
+
+#include "os_graph.h"
+#include "os_threadpool.h"
+
+/*
+ * Level-synchronous breadth-first traversal of every component of the graph,
+ * switching between top-down and bottom-up steps (Beamer et al.,
+ * "Direction-Optimizing Breadth-First Search", SC 2012). Each level is split
+ * in chunks run with tp_parallel_for(). Returns the sum of the node values.
+ */
+long long bfs_traverse(os_threadpool_t *tp, os_graph_t *graph);
+
+#endif
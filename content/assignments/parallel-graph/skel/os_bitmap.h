@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_BITMAP_H__
+#define __OS_BITMAP_H__
+
+#include <stdlib.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#define BITS_PER_WORD (sizeof(unsigned long) * CHAR_BIT)
+
+/* Bitmap of n bits, all cleared; free with free() */
+static inline atomic_ulong *bitmap_create(size_t n)
+{
+	return calloc(n / BITS_PER_WORD + 1, sizeof(atomic_ulong));
+}
+
+static inline int bitmap_test(atomic_ulong *bits, size_t i)
+{
+	return (atomic_load_explicit(&bits[i / BITS_PER_WORD], memory_order_relaxed) >>
+		(i % BITS_PER_WORD)) & 1;
+}
+
+static inline void bitmap_set(atomic_ulong *bits, size_t i)
+{
+	atomic_fetch_or_explicit(&bits[i / BITS_PER_WORD], 1UL << (i % BITS_PER_WORD),
+				 memory_order_relaxed);
+}
+
+/* Atomically set bit i; returns 1 if this call set it, 0 if it was already set */
+static inline int bitmap_claim(atomic_ulong *bits, size_t i)
+{
+	atomic_ulong *word = &bits[i / BITS_PER_WORD];
+	unsigned long mask = 1UL << (i % BITS_PER_WORD);
+
+	// Skip the atomic write when the bit is already set
+	if (atomic_load_explicit(word, memory_order_relaxed) & mask)
+		return 0;
+	return !(atomic_fetch_or_explicit(word, mask, memory_order_relaxed) & mask);
+}
+
+#endif
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "os_cc.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/* Nodes per linking task, small enough to spread high-degree nodes around */
+#define CC_LINK_GRAIN 4096
+
+typedef struct {
+	os_graph_t *graph;
+	atomic_uint *parent;		// Union-find forest; roots are their own parent
+	atomic_llong *sums;		// Per root, sum of the component's values
+	atomic_uint *sizes;		// Per root, nodes in the component
+} cc_state_t;
+
+/* Root of v's tree, halving the path on the way */
+static unsigned int cc_find(atomic_uint *parent, unsigned int v)
+{
+	for (;;) {
+		unsigned int p = atomic_load_explicit(&parent[v], memory_order_relaxed);
+
+		if (p == v)
+			return v;
+
+		unsigned int gp = atomic_load_explicit(&parent[p], memory_order_relaxed);
+
+		// A failed exchange only means another thread moved v up already
+		if (gp != p)
+			atomic_compare_exchange_weak_explicit(&parent[v], &p, gp,
+							      memory_order_relaxed,
+							      memory_order_relaxed);
+		v = gp;
+	}
+}
+
+/*
+ * Merge the trees of u and v. The larger root is always linked below the
+ * smaller one, so no cycle can form and every root ends up being the
+ * smallest node of its component.
+ */
+static void cc_union(atomic_uint *parent, unsigned int u, unsigned int v)
+{
+	for (;;) {
+		u = cc_find(parent, u);
+		v = cc_find(parent, v);
+		if (u == v)
+			return;
+		if (u < v) {
+			unsigned int t = u;
+
+			u = v;
+			v = t;
+		}
+
+		unsigned int expected = u;
+
+		// Fails if u stopped being a root meanwhile; retry from the new roots
+		if (atomic_compare_exchange_weak_explicit(&parent[u], &expected, v,
+							  memory_order_relaxed,
+							  memory_order_relaxed))
+			return;
+	}
+}
+
+static void cc_init(void *ctx, size_t begin, size_t end)
+{
+	cc_state_t *s = ctx;
+
+	for (size_t v = begin; v < end; ++v) {
+		atomic_init(&s->parent[v], v);
+		atomic_init(&s->sums[v], 0);
+		atomic_init(&s->sizes[v], 0);
+	}
+}
+
+/* Link every edge once, from its larger end */
+static void cc_link(void *ctx, size_t begin, size_t end)
+{
+	cc_state_t *s = ctx;
+
+	for (size_t v = begin; v < end; ++v) {
+		unsigned int *neighbours = os_graph_neighbours(s->graph, v);
+		unsigned int degree = os_graph_degree(s->graph, v);
+
+		for (unsigned int j = 0; j < degree; ++j)
+			if (neighbours[j] < v)
+				cc_union(s->parent, v, neighbours[j]);
+	}
+}
+
+/* Add every node to its root; consecutive nodes mostly share a root */
+static void cc_sum(void *ctx, size_t begin, size_t end)
+{
+	cc_state_t *s = ctx;
+	unsigned int root = 0, size = 0;
+	long long sum = 0;
+
+	for (size_t v = begin; v < end; ++v) {
+		unsigned int r = cc_find(s->parent, v);
+
+		if (r != root && size > 0) {
+			atomic_fetch_add_explicit(&s->sums[root], sum, memory_order_relaxed);
+			atomic_fetch_add_explicit(&s->sizes[root], size, memory_order_relaxed);
+			sum = 0;
+			size = 0;
+		}
+		root = r;
+		sum += os_graph_value(s->graph, v);
+		size++;
+	}
+	if (size > 0) {
+		atomic_fetch_add_explicit(&s->sums[root], sum, memory_order_relaxed);
+		atomic_fetch_add_explicit(&s->sizes[root], size, memory_order_relaxed);
+	}
+}
+
+long long cc_traverse(os_threadpool_t *tp, os_graph_t *graph, FILE *out)
+{
+	size_t n = graph->nCount;
+	long long total = 0;
+	cc_state_t s = {
+		.graph = graph,
+		.parent = malloc(n * sizeof(atomic_uint) + 1),
+		.sums = malloc(n * sizeof(atomic_llong) + 1),
+		.sizes = malloc(n * sizeof(atomic_uint) + 1),
+	};
+
+	if (s.parent == NULL || s.sums == NULL || s.sizes == NULL) {
+		puts("[ERROR] [cc] Not enough memory");
+		exit(-1);
+	}
+
+	tp_parallel_for(tp, 0, n, 0, cc_init, &s);
+	tp_parallel_for(tp, 0, n, CC_LINK_GRAIN, cc_link, &s);
+	tp_parallel_for(tp, 0, n, 0, cc_sum, &s);
+
+	// Roots are the smallest node of their component, so this lists the
+	// components in the order of their first node
+	for (size_t v = 0; v < n; ++v) {
+		if (atomic_load_explicit(&s.parent[v], memory_order_relaxed) != v)
+			continue;
+
+		long long sum = atomic_load_explicit(&s.sums[v], memory_order_relaxed);
+
+		total += sum;
+		if (out != NULL)
+			fprintf(out, "%zu %u %lld\n", v,
+				atomic_load_explicit(&s.sizes[v], memory_order_relaxed), sum);
+	}
+
+	free(s.sizes);
+	free(s.sums);
+	free(s.parent);
+	return total;
+}
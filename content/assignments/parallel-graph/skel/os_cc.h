@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_CC_H__
+#define __OS_CC_H__
+
+#include <stdio.h>
+#include "os_graph.h"
+#include "os_threadpool.h"
+
+/*
+ * Find the connected components of the graph with a lock-free union-find,
+ * all edges being linked in parallel, and sum the node values of every
+ * component. If out is not NULL, one line per component is printed to it:
+ * the component's smallest node, its size and its sum. Returns the sum of
+ * all node values.
+ */
+long long cc_traverse(os_threadpool_t *tp, os_graph_t *graph, FILE *out);
+
+#endif
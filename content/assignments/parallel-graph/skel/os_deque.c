@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "os_deque.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * Memory orderings follow "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013).
+ */
+
+static os_deque_array_t *deque_array_create(size_t size)
+{
+	os_deque_array_t *a = malloc(sizeof(*a) + size * sizeof(a->buffer[0]));
+
+	if (a == NULL)
+		return NULL;
+	a->size = size;
+	a->prev = NULL;
+	return a;
+}
+
+/* Double the array of a full deque, copying the live range [t, b) */
+static os_deque_array_t *deque_grow(os_deque_t *q, os_deque_array_t *a, long t, long b)
+{
+	os_deque_array_t *n = deque_array_create(a->size * 2);
+	long i;
+
+	if (n == NULL) {
+		puts("[ERROR] [deque_grow] Not enough memory");
+		exit(-1);
+	}
+
+	for (i = t; i < b; i++)
+		atomic_store_explicit(&n->buffer[i & (n->size - 1)],
+				      atomic_load_explicit(&a->buffer[i & (a->size - 1)], memory_order_relaxed),
+				      memory_order_relaxed);
+	n->prev = a;
+	atomic_store_explicit(&q->array, n, memory_order_release);
+	return n;
+}
+
+/* Initialize an empty deque; size is rounded up to a power of two */
+int deque_init(os_deque_t *q, size_t size)
+{
+	size_t s = 1;
+
+	while (s < size)
+		s <<= 1;
+
+	os_deque_array_t *a = deque_array_create(s);
+
+	if (a == NULL)
+		return -1;
+	atomic_init(&q->top, 0);
+	atomic_init(&q->bottom, 0);
+	atomic_init(&q->array, a);
+	return 0;
+}
+
+/* Free the deque arrays; no thread may use the deque afterwards */
+void deque_destroy(os_deque_t *q)
+{
+	os_deque_array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+
+	while (a != NULL) {
+		os_deque_array_t *prev = a->prev;
+
+		free(a);
+		a = prev;
+	}
+	atomic_store_explicit(&q->array, NULL, memory_order_relaxed);
+}
+
+/* Push an element at the bottom of the deque (owner only) */
+void deque_push(os_deque_t *q, void *info)
+{
+	long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&q->top, memory_order_acquire);
+	os_deque_array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+
+	if (b - t > (long) a->size - 1)
+		a = deque_grow(q, a, t, b);
+
+	atomic_store_explicit(&a->buffer[b & (a->size - 1)], info, memory_order_relaxed);
+	// Publish the element to thieves acquiring bottom
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+}
+
+/* Pop the most recently pushed element, or NULL if empty (owner only) */
+void *deque_pop(os_deque_t *q)
+{
+	long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	os_deque_array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+	long t;
+	void *info = NULL;
+
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+	if (t <= b) {
+		info = atomic_load_explicit(&a->buffer[b & (a->size - 1)], memory_order_relaxed);
+		if (t == b) {
+			// Last element: race against thieves for it
+			if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+								     memory_order_seq_cst, memory_order_relaxed))
+				info = NULL;
+			atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+	}
+	return info;
+}
+
+/* Steal the oldest element; NULL if empty or if another thread won the race */
+void *deque_steal(os_deque_t *q)
+{
+	long t = atomic_load_explicit(&q->top, memory_order_acquire);
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+	void *info = NULL;
+
+	if (t < b) {
+		os_deque_array_t *a = atomic_load_explicit(&q->array, memory_order_acquire);
+
+		info = atomic_load_explicit(&a->buffer[t & (a->size - 1)], memory_order_relaxed);
+		if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+							     memory_order_seq_cst, memory_order_relaxed))
+			return NULL;
+	}
+	return info;
+}
+
+/* Approximate number of elements, for heuristics only */
+long deque_size(os_deque_t *q)
+{
+	long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+	return b > t ? b - t : 0;
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef __OS_DEQUE_H__
+#define __OS_DEQUE_H__
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define OS_CACHE_LINE 64
+
+/*
+ * Chase-Lev work-stealing deque.
+ *
+ * The owner thread pushes and pops at the bottom end, any other thread may
+ * steal from the top end. Only the owner may call deque_push() and
+ * deque_pop(). Arrays replaced on growth are kept on the prev list until the
+ * deque is destroyed, since a concurrent thief may still be reading them.
+ */
+typedef struct os_deque_array_t {
+	size_t size;				// Always a power of two
+	struct os_deque_array_t *prev;
+	_Atomic(void *) buffer[];
+} os_deque_array_t;
+
+typedef struct {
+	_Alignas(OS_CACHE_LINE) atomic_long top;
+	_Alignas(OS_CACHE_LINE) atomic_long bottom;
+	_Atomic(os_deque_array_t *) array;
+} os_deque_t;
+
+int deque_init(os_deque_t *q, size_t size);
+void deque_destroy(os_deque_t *q);
+void deque_push(os_deque_t *q, void *info);
+void *deque_pop(os_deque_t *q);
+void *deque_steal(os_deque_t *q);
+long deque_size(os_deque_t *q);
+
+#endif
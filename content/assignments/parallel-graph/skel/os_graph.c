@@ -1,79 +1,115 @@
 #include "os_graph.h"
 #include <stdio.h>
 #include <stdlib.h>
-
-/*             [ ==== NODE FUNCTIONS === ]               */
-os_node_t *os_create_node(unsigned int _nodeID, int _nodeInfo)
-{
-    os_node_t *newNode = calloc(1, sizeof(os_node_t));
-
-    newNode->nodeID = _nodeID;
-    newNode->nodeInfo = _nodeInfo;
-
-    return newNode;
-}
+#include <string.h>
+#include <sys/mman.h>
 
 /*             [ ==== GRAPH FUNCTIONS === ]              */
 os_graph_t *create_graph_from_data(unsigned int nc, unsigned int ec,
         int *values, os_edge_t *edges)
 {
-    int i, isrc, idst;
+    unsigned int i, isrc, idst;
+    size_t *pos;
     os_graph_t *graph = calloc(1, sizeof(os_graph_t));
 
     graph->nCount = nc;
     graph->eCount = ec;
 
-    graph->nodes = calloc(nc, sizeof(os_node_t *));
+    graph->values = malloc(nc * sizeof(int));
+    graph->offsets = calloc(nc + 1, sizeof(size_t));
+    graph->adjacency = malloc(2 * (size_t) ec * sizeof(unsigned int));
+    pos = malloc(nc * sizeof(size_t));
+    if ((graph->values == NULL && nc > 0) || graph->offsets == NULL ||
+            (graph->adjacency == NULL && ec > 0) || (pos == NULL && nc > 0)) {
+        printf("[ERROR] Not enough memory for the graph\n");
+        free(pos);
+        destroy_graph(graph);
+        return NULL;
+    }
+
+    memcpy(graph->values, values, nc * sizeof(int));
+
+    // Count the degree of every node, then turn counts into offsets
+    for (i = 0; i < ec; ++i) {
+        isrc = edges[i].src; idst = edges[i].dst;
+        if (isrc >= nc || idst >= nc) {
+            printf("[ERROR] Edge %u has an invalid node\n", i);
+            free(pos);
+            destroy_graph(graph);
+            return NULL;
+        }
+
+        graph->offsets[isrc + 1]++;
+        graph->offsets[idst + 1]++;
+    }
 
     for (i = 0; i < nc; ++i) {
-        graph->nodes[i] = os_create_node(i, values[i]);
-        graph->nodes[i]->neighbours = calloc(nc, sizeof(unsigned int));
-        graph->nodes[i]->cNeighbours = 0;
+        graph->offsets[i + 1] += graph->offsets[i];
+        pos[i] = graph->offsets[i];
     }
 
+    // Neighbours keep the order of the edges in the input
     for (i = 0; i < ec; ++i) {
         isrc = edges[i].src; idst = edges[i].dst;
 
-        graph->nodes[isrc]->neighbours[graph->nodes[isrc]->cNeighbours++] = idst;
+        graph->adjacency[pos[isrc]++] = idst;
 
-        graph->nodes[idst]->neighbours[graph->nodes[idst]->cNeighbours++] = isrc;
+        graph->adjacency[pos[idst]++] = isrc;
     }
+    free(pos);
 
-    graph->visited = calloc(graph->nCount, sizeof(unsigned int));
     return graph;
 }
 
-os_graph_t *create_graph_from_file(FILE *file)
+/*
+ * Graph with the same shape as graph and arrays left unwritten, to be filled
+ * with os_graph_copy_part(). Large allocations get memory on first write, so
+ * each part ends up on the NUMA node of the thread that copies it.
+ */
+os_graph_t *os_graph_alloc_copy(os_graph_t *graph)
 {
-    unsigned int nCount, eCount;
-    int i;
-    int *values;
-    os_edge_t *edges;
-    os_graph_t *graph;
-
-    if (fscanf(file, "%d %d", &nCount, &eCount) == 0) {
-        printf("[ERROR] Can't read from file\n");
+    os_graph_t *copy = calloc(1, sizeof(os_graph_t));
+    size_t nc = graph->nCount, adjCount = graph->offsets[nc];
+
+    copy->nCount = graph->nCount;
+    copy->eCount = graph->eCount;
+    copy->values = malloc(nc * sizeof(int));
+    copy->offsets = malloc((nc + 1) * sizeof(size_t));
+    copy->adjacency = malloc(adjCount * sizeof(unsigned int));
+    if ((copy->values == NULL && nc > 0) || copy->offsets == NULL ||
+            (copy->adjacency == NULL && adjCount > 0)) {
+        printf("[ERROR] Not enough memory for the graph\n");
+        destroy_graph(copy);
         return NULL;
     }
+    copy->offsets[nc] = adjCount;
+    return copy;
+}
 
-    values = malloc(nCount * sizeof(int));
-    for (i = 0; i < nCount; ++i) {
-        if (fscanf(file, "%d", &values[i]) == 0) {
-            printf("[ERROR] Can't read from file\n");
-            return NULL;
-        }
-    }
+/* Copy the nodes [begin, end) of src, with their neighbours, into dst */
+void os_graph_copy_part(os_graph_t *dst, os_graph_t *src, unsigned int begin, unsigned int end)
+{
+    size_t first = src->offsets[begin], last = src->offsets[end];
 
-    edges = malloc(eCount * sizeof(os_edge_t));
-    for (i = 0; i < eCount; ++i) {
-        if (fscanf(file, "%d %d", &edges[i].src, &edges[i].dst) == 0) {
-            printf("[ERROR] Can't read from file\n");
-            return NULL;
-        }
-    }
+    memcpy(dst->values + begin, src->values + begin, (end - begin) * sizeof(int));
+    memcpy(dst->offsets + begin, src->offsets + begin, (end - begin) * sizeof(size_t));
+    memcpy(dst->adjacency + first, src->adjacency + first, (last - first) * sizeof(unsigned int));
+}
 
-    graph = create_graph_from_data(nCount, eCount, values, edges);
-    return graph;
+void destroy_graph(os_graph_t *graph)
+{
+    if (graph == NULL)
+        return;
+
+    if (graph->mapping != NULL) {
+        munmap(graph->mapping, graph->mappingSize);
+    } else {
+        free(graph->values);
+        free(graph->offsets);
+        free(graph->adjacency);
+    }
+    free(graph->visited);
+    free(graph);
 }
 
 void printGraph(os_graph_t *graph)
@@ -81,8 +117,8 @@ void printGraph(os_graph_t *graph)
     int i, j;
     for (i = 0; i < graph->nCount; ++i) {
         printf("[%d]: ", i);
-        for (j = 0; j < graph->nodes[i]->cNeighbours; ++j) {
-            printf("%d ", graph->nodes[i]->neighbours[j]);
+        for (j = 0; j < os_graph_degree(graph, i); ++j) {
+            printf("%d ", os_graph_neighbours(graph, i)[j]);
         }
         printf("\n");
     }
@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stddef.h>
 
 #ifndef __OS_GRAPH_H__
 #define __OS_GRAPH_H__
 
+/* View of one node of the graph, pointing into the graph's arrays */
 typedef struct os_node_t {
     unsigned int nodeID;
     signed int nodeInfo;
@@ -11,22 +13,61 @@ typedef struct os_node_t {
     unsigned int *neighbours;
 } os_node_t;
 
+/*
+ * The graph is stored in compressed sparse row format: the neighbours of
+ * node i are adjacency[offsets[i]] .. adjacency[offsets[i + 1] - 1]. Every
+ * edge is stored in both directions, so adjacency has 2 * eCount entries.
+ */
 typedef struct os_graph_t {
     unsigned int nCount;        // Nodes count
     unsigned int eCount;        // Edges count
 
-    os_node_t **nodes;
-    unsigned int *visited;
+    int *values;                // Node values, nCount entries
+    size_t *offsets;            // nCount + 1 entries
+    unsigned int *adjacency;
+    unsigned int *visited;      // Left NULL, allocated by the traversals that use it
+
+    // Set when the arrays point into a mapped binary graph file
+    void *mapping;
+    size_t mappingSize;
 } os_graph_t;
 
 typedef struct os_edge_t {
     int src, dst;
 } os_edge_t;
 
-os_node_t *os_create_node(unsigned int, int);
+static inline int os_graph_value(os_graph_t *graph, unsigned int nodeIdx)
+{
+    return graph->values[nodeIdx];
+}
+
+static inline unsigned int os_graph_degree(os_graph_t *graph, unsigned int nodeIdx)
+{
+    return graph->offsets[nodeIdx + 1] - graph->offsets[nodeIdx];
+}
+
+static inline unsigned int *os_graph_neighbours(os_graph_t *graph, unsigned int nodeIdx)
+{
+    return graph->adjacency + graph->offsets[nodeIdx];
+}
+
+static inline os_node_t os_graph_node(os_graph_t *graph, unsigned int nodeIdx)
+{
+    os_node_t node = {
+        .nodeID = nodeIdx,
+        .nodeInfo = os_graph_value(graph, nodeIdx),
+        .cNeighbours = os_graph_degree(graph, nodeIdx),
+        .neighbours = os_graph_neighbours(graph, nodeIdx),
+    };
+
+    return node;
+}
 
-os_graph_t *create_graph();
 os_graph_t *create_graph_from_data(unsigned int, unsigned int, int *, os_edge_t *);
 os_graph_t *create_graph_from_file(FILE *);
+int write_graph_binary(os_graph_t *, FILE *);
+os_graph_t *os_graph_alloc_copy(os_graph_t *);
+void os_graph_copy_part(os_graph_t *, os_graph_t *, unsigned int, unsigned int);
+void destroy_graph(os_graph_t *);
 void printGraph(os_graph_t *);
 #endif
@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "os_graph.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Binary graph files hold the CSR arrays as they are laid out in memory
+ * (native byte order), so they can be mapped and used without parsing:
+ *
+ *   header      magic "OSGRAPH1", u32 nCount, u32 eCount
+ *   values      i32[nCount], zero padded to a multiple of 8 bytes
+ *   offsets     u64[nCount + 1]
+ *   adjacency   u32[2 * eCount]
+ */
+#define OS_GRAPH_MAGIC "OSGRAPH1"
+
+typedef struct {
+	char magic[8];
+	uint32_t nCount;
+	uint32_t eCount;
+} os_graph_file_header_t;
+
+_Static_assert(sizeof(size_t) == sizeof(uint64_t), "offsets are mapped as size_t");
+
+/* Text files are split in chunks of at least this many bytes per thread */
+#define PARSE_CHUNK_MIN (1 << 20)
+#define PARSE_MAX_THREADS 64
+
+typedef struct {
+	const char *begin, *end;
+	size_t first;			// Index of the chunk's first integer in the file
+	size_t count;			// Integers in the chunk
+	int error;
+
+	pthread_t thread;
+	int threaded;
+	unsigned int nCount;		// Integers [0, nCount) are values, the rest edges
+	size_t needed;
+	int *values;
+	os_edge_t *edges;
+} parse_chunk_t;
+
+static inline int is_blank(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/*
+ * Parse one integer in [min, max] starting at *p, leaving *p right after it.
+ * Integers out of range are rejected rather than truncated.
+ */
+static int parse_int(const char **p, const char *end, long min, long max, long *value)
+{
+	const char *s = *p;
+	int negative = 0;
+	long limit, v = 0;
+
+	if (s < end && (*s == '-' || *s == '+'))
+		negative = *s++ == '-';
+	if (s == end || *s < '0' || *s > '9')
+		return -1;
+	limit = negative ? -min : max;
+	while (s < end && *s >= '0' && *s <= '9') {
+		int digit = *s++ - '0';
+
+		// v <= limit <= UINT_MAX, so this can't overflow a long
+		if (v * 10 + digit > limit)
+			return -1;
+		v = v * 10 + digit;
+	}
+	if (s < end && !is_blank(*s))
+		return -1;
+
+	*value = negative ? -v : v;
+	*p = s;
+	return 0;
+}
+
+static const char *skip_blanks(const char *p, const char *end)
+{
+	while (p < end && is_blank(*p))
+		p++;
+	return p;
+}
+
+static void *count_chunk(void *arg)
+{
+	parse_chunk_t *c = arg;
+	const char *p = c->begin;
+
+	c->count = 0;
+	while ((p = skip_blanks(p, c->end)) < c->end) {
+		c->count++;
+		while (p < c->end && !is_blank(*p))
+			p++;
+	}
+	return NULL;
+}
+
+static void *parse_chunk(void *arg)
+{
+	parse_chunk_t *c = arg;
+	const char *p = c->begin;
+	size_t idx = c->first;
+	long v;
+
+	while ((p = skip_blanks(p, c->end)) < c->end && idx < c->needed) {
+		if (parse_int(&p, c->end, INT_MIN, INT_MAX, &v) < 0) {
+			c->error = 1;
+			return NULL;
+		}
+		if (idx < c->nCount)
+			c->values[idx] = v;
+		else if ((idx - c->nCount) % 2 == 0)
+			c->edges[(idx - c->nCount) / 2].src = v;
+		else
+			c->edges[(idx - c->nCount) / 2].dst = v;
+		idx++;
+	}
+	return NULL;
+}
+
+/* Run fn on every chunk, using one thread per chunk */
+static void run_chunks(parse_chunk_t *chunks, unsigned int nChunks, void *(*fn)(void *))
+{
+	unsigned int i;
+
+	// Chunks whose thread can't be created are run by the caller
+	for (i = 1; i < nChunks; ++i)
+		chunks[i].threaded = pthread_create(&chunks[i].thread, NULL, fn, &chunks[i]) == 0;
+	fn(&chunks[0]);
+	for (i = 1; i < nChunks; ++i) {
+		if (chunks[i].threaded)
+			pthread_join(chunks[i].thread, NULL);
+		else
+			fn(&chunks[i]);
+	}
+}
+
+static os_graph_t *parse_text(const char *buf, size_t size)
+{
+	const char *p = buf, *end = buf + size;
+	long nCount, eCount;
+	unsigned int nChunks, i;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	parse_chunk_t *chunks;
+	size_t needed, total;
+	int *values;
+	os_edge_t *edges;
+	os_graph_t *graph = NULL;
+
+	p = skip_blanks(p, end);
+	if (parse_int(&p, end, 0, UINT_MAX, &nCount) < 0)
+		return NULL;
+	p = skip_blanks(p, end);
+	if (parse_int(&p, end, 0, UINT_MAX, &eCount) < 0)
+		return NULL;
+
+	needed = nCount + 2 * (size_t) eCount;
+	values = malloc(nCount * sizeof(int) + 1);
+	edges = malloc(eCount * sizeof(os_edge_t) + 1);
+
+	nChunks = (end - p) / PARSE_CHUNK_MIN;
+	if (nChunks > ncpu)
+		nChunks = ncpu;
+	if (nChunks > PARSE_MAX_THREADS)
+		nChunks = PARSE_MAX_THREADS;
+	if (nChunks == 0)
+		nChunks = 1;
+	chunks = calloc(nChunks, sizeof(parse_chunk_t));
+	if (values == NULL || edges == NULL || chunks == NULL) {
+		printf("[ERROR] Not enough memory for the graph\n");
+		goto out;
+	}
+
+	// Chunk boundaries are moved forward to a blank, so no integer is split
+	for (i = 0; i < nChunks; ++i) {
+		const char *b = i == 0 ? p : chunks[i - 1].end;
+		const char *e = i == nChunks - 1 ? end : p + (end - p) / nChunks * (i + 1);
+
+		if (e < b)
+			e = b;
+		while (e < end && !is_blank(*e))
+			e++;
+		chunks[i] = (parse_chunk_t) {
+			.begin = b, .end = e, .nCount = nCount, .needed = needed,
+			.values = values, .edges = edges,
+		};
+	}
+
+	// First count the integers of every chunk, then parse each of them
+	// knowing where its first integer goes
+	run_chunks(chunks, nChunks, count_chunk);
+	for (i = 0, total = 0; i < nChunks; ++i) {
+		chunks[i].first = total;
+		total += chunks[i].count;
+	}
+	if (total < needed)
+		goto out;
+
+	run_chunks(chunks, nChunks, parse_chunk);
+	for (i = 0; i < nChunks; ++i)
+		if (chunks[i].error)
+			goto out;
+
+	graph = create_graph_from_data(nCount, eCount, values, edges);
+
+out:
+	free(chunks);
+	free(values);
+	free(edges);
+	return graph;
+}
+
+/* Size of the binary file of a graph, and where each array starts in it */
+static size_t binary_layout(size_t nCount, size_t eCount, size_t *offsetsPos, size_t *adjacencyPos)
+{
+	size_t valuesEnd = sizeof(os_graph_file_header_t) + nCount * sizeof(int32_t);
+
+	*offsetsPos = (valuesEnd + 7) & ~(size_t) 7;
+	*adjacencyPos = *offsetsPos + (nCount + 1) * sizeof(uint64_t);
+	return *adjacencyPos + 2 * eCount * sizeof(uint32_t);
+}
+
+/*
+ * Use the arrays of a binary graph file in place. If the buffer is not a
+ * mapping of the file, the arrays are copied out of it.
+ */
+static os_graph_t *load_binary(void *buf, size_t size, int mapped)
+{
+	os_graph_file_header_t *h = buf;
+	size_t offsetsPos, adjacencyPos, i;
+	os_graph_t *graph;
+
+	if (size < sizeof(*h) ||
+	    binary_layout(h->nCount, h->eCount, &offsetsPos, &adjacencyPos) > size)
+		return NULL;
+
+	graph = calloc(1, sizeof(os_graph_t));
+	if (graph == NULL)
+		return NULL;
+	graph->nCount = h->nCount;
+	graph->eCount = h->eCount;
+	graph->values = (int *) ((char *) buf + sizeof(*h));
+	graph->offsets = (size_t *) ((char *) buf + offsetsPos);
+	graph->adjacency = (unsigned int *) ((char *) buf + adjacencyPos);
+
+	if (graph->offsets[0] != 0 ||
+	    graph->offsets[graph->nCount] != 2 * (size_t) graph->eCount)
+		goto err;
+	for (i = 0; i < graph->nCount; ++i)
+		if (graph->offsets[i] > graph->offsets[i + 1])
+			goto err;
+	for (i = 0; i < 2 * (size_t) graph->eCount; ++i)
+		if (graph->adjacency[i] >= graph->nCount)
+			goto err;
+
+	if (mapped) {
+		graph->mapping = buf;
+		graph->mappingSize = size;
+		return graph;
+	}
+
+	int *values = malloc(graph->nCount * sizeof(int) + 1);
+	size_t *offsets = malloc((graph->nCount + 1) * sizeof(size_t));
+	unsigned int *adjacency = malloc(2 * (size_t) graph->eCount * sizeof(unsigned int) + 1);
+
+	if (values == NULL || offsets == NULL || adjacency == NULL) {
+		free(values);
+		free(offsets);
+		free(adjacency);
+		goto err;
+	}
+	memcpy(values, graph->values, graph->nCount * sizeof(int));
+	memcpy(offsets, graph->offsets, (graph->nCount + 1) * sizeof(size_t));
+	memcpy(adjacency, graph->adjacency, 2 * (size_t) graph->eCount * sizeof(unsigned int));
+	graph->values = values;
+	graph->offsets = offsets;
+	graph->adjacency = adjacency;
+	return graph;
+
+err:
+	free(graph);
+	return NULL;
+}
+
+/* Read a whole stream that can't be mapped (e.g. a pipe) */
+static char *read_all(FILE *file, size_t *size)
+{
+	size_t cap = 1 << 16, len = 0, n;
+	char *buf = malloc(cap), *tmp;
+
+	while (buf != NULL && (n = fread(buf + len, 1, cap - len, file)) > 0) {
+		len += n;
+		if (len == cap) {
+			cap *= 2;
+			tmp = realloc(buf, cap);
+			if (tmp == NULL)
+				free(buf);
+			buf = tmp;
+		}
+	}
+	*size = len;
+	return buf;
+}
+
+/*
+ * Load a graph from a text or binary graph file. Regular files are mapped
+ * and text is parsed by several threads, each on a chunk of the file.
+ */
+os_graph_t *create_graph_from_file(FILE *file)
+{
+	struct stat st;
+	char *buf = NULL;
+	size_t size = 0;
+	int mapped = 0;
+	os_graph_t *graph;
+
+	if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		size = st.st_size;
+		buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+		if (buf == MAP_FAILED)
+			buf = NULL;
+		else
+			mapped = 1;
+	}
+	if (buf == NULL)
+		buf = read_all(file, &size);
+	if (buf == NULL) {
+		printf("[ERROR] Can't read from file\n");
+		return NULL;
+	}
+
+	if (size >= sizeof(os_graph_file_header_t) && memcmp(buf, OS_GRAPH_MAGIC, 8) == 0) {
+		if (mapped)
+			madvise(buf, size, MADV_WILLNEED);
+		graph = load_binary(buf, size, mapped);
+		if (graph != NULL && graph->mapping != NULL)
+			return graph;
+	} else {
+		if (mapped)
+			madvise(buf, size, MADV_SEQUENTIAL);
+		graph = parse_text(buf, size);
+	}
+
+	if (mapped)
+		munmap(buf, size);
+	else
+		free(buf);
+
+	if (graph == NULL)
+		printf("[ERROR] Can't read from file\n");
+	return graph;
+}
+
+/* Write a graph in the binary format; returns 0 on success, -1 on error */
+int write_graph_binary(os_graph_t *graph, FILE *file)
+{
+	os_graph_file_header_t h = {
+		.magic = OS_GRAPH_MAGIC,
+		.nCount = graph->nCount,
+		.eCount = graph->eCount,
+	};
+	static const char padding[8];
+	size_t offsetsPos, adjacencyPos;
+	size_t valuesEnd = sizeof(h) + graph->nCount * sizeof(int32_t);
+
+	binary_layout(graph->nCount, graph->eCount, &offsetsPos, &adjacencyPos);
+
+	if (fwrite(&h, sizeof(h), 1, file) != 1 ||
+	    fwrite(graph->values, sizeof(int32_t), graph->nCount, file) != graph->nCount ||
+	    fwrite(padding, 1, offsetsPos - valuesEnd, file) != offsetsPos - valuesEnd ||
+	    fwrite(graph->offsets, sizeof(uint64_t), graph->nCount + 1, file) != graph->nCount + 1 ||
+	    fwrite(graph->adjacency, sizeof(uint32_t), 2 * (size_t) graph->eCount, file) !=
+			2 * (size_t) graph->eCount)
+		return -1;
+	return 0;
+}
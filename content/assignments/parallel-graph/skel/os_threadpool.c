@@ -1,9 +1,37 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
 #include "os_threadpool.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <dirent.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <libgen.h>
+
+/* Worker run by the current thread, NULL outside of any pool */
+static __thread os_worker_t *self;
+
+/* Trace events kept per worker; later ones are only counted */
+#define TRACE_MAX_EVENTS (1 << 20)
+
+/* Monotonic clock, read through the vDSO without a system call */
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The calling worker, if it belongs to tp */
+static inline os_worker_t *pool_worker(os_threadpool_t *tp)
+{
+	return self != NULL && self->pool == tp ? self : NULL;
+}
 
 /* === TASK === */
 
@@ -17,97 +45,596 @@ os_task_t *task_create(void *arg, void (*f)(void *))
 	return task;
 }
 
-/* Add a new task to threadpool task queue */
-void add_task_in_queue(os_threadpool_t *tp, os_task_t *t)
+/* Runs the slice of a range task */
+static void run_range_task(void *arg)
+{
+	os_range_task_t *rt = arg;
+
+	rt->func(rt->argument, rt->begin, rt->end);
+}
+
+/* Creates a task that runs f(arg, begin, end) */
+os_task_t *range_task_create(void *arg, void (*f)(void *, unsigned int, unsigned int),
+			     unsigned int begin, unsigned int end)
+{
+	os_range_task_t *rt = malloc(sizeof(os_range_task_t));
+
+	rt->task.argument = rt;
+	rt->task.task = run_range_task;
+	rt->argument = arg;
+	rt->func = f;
+	rt->begin = begin;
+	rt->end = end;
+	return &rt->task;
+}
+
+/* Wake up sleeping workers, if any, after n tasks were queued */
+static void wake_workers(os_threadpool_t *tp, unsigned int n)
+{
+	// Pairs with the sleeping increment / queued check in wait_for_task()
+	if (atomic_load(&tp->sleeping) == 0)
+		return;
+
+	pthread_mutex_lock(&tp->waitLock);
+	if (n == 1)
+		pthread_cond_signal(&tp->taskCond);
+	else
+		pthread_cond_broadcast(&tp->taskCond);
+	pthread_mutex_unlock(&tp->waitLock);
+}
+
+/* Add tasks to the queue of tasks submitted from outside the pool */
+static void add_external_tasks(os_threadpool_t *tp, os_task_t **tasks, unsigned int n)
 {
 	pthread_mutex_lock(&tp->taskLock);
 
-	os_task_queue_t *task = malloc(sizeof(os_task_queue_t));
+	size_t count = atomic_load_explicit(&tp->nTasks, memory_order_relaxed);
 
-	task->task = t;
-	task->next = tp->tasks;
-	tp->tasks = task;
+	if (count + n > tp->tasksCap) {
+		size_t cap = tp->tasksCap ? tp->tasksCap : 64;
+
+		while (cap < count + n)
+			cap *= 2;
+		tp->tasks = realloc(tp->tasks, cap * sizeof(os_task_t *));
+		if (tp->tasks == NULL) {
+			puts("Error allocating task queue");
+			exit(-1);
+		}
+		tp->tasksCap = cap;
+	}
+	memcpy(tp->tasks + count, tasks, n * sizeof(os_task_t *));
+	atomic_store_explicit(&tp->nTasks, count + n, memory_order_relaxed);
 
 	pthread_mutex_unlock(&tp->taskLock);
 }
 
-/* Get the head of task queue from threadpool */
-os_task_t *get_task(os_threadpool_t *tp)
+/* Add a batch of tasks, paying for the bookkeeping and wake-up only once */
+void add_tasks_in_queue(os_threadpool_t *tp, os_task_t **tasks, unsigned int n)
 {
-	pthread_mutex_lock(&tp->taskLock);
-	if (tp->tasks == NULL) {
-		pthread_mutex_unlock(&tp->taskLock);
-		return NULL;
+	unsigned int i;
+
+	if (n == 0)
+		return;
+
+	atomic_fetch_add(&tp->pending, n);
+
+	// Workers push on their own deque, without locking or allocating
+	if (self != NULL && self->pool == tp) {
+		for (i = 0; i < n; ++i)
+			deque_push(&self->deque, tasks[i]);
+		if (tp->instrument) {
+			long depth = deque_size(&self->deque);
+
+			if (depth > self->stats.maxDepth)
+				self->stats.maxDepth = depth;
+		}
+	} else {
+		add_external_tasks(tp, tasks, n);
+	}
+
+	atomic_fetch_add(&tp->queued, n);
+	wake_workers(tp, n);
+}
+
+/* Add a new task to threadpool task queue */
+void add_task_in_queue(os_threadpool_t *tp, os_task_t *t)
+{
+	add_tasks_in_queue(tp, &t, 1);
+}
+
+/* Split [begin, end) in range tasks of at most grain elements and add them */
+void add_range_tasks(os_threadpool_t *tp, void *arg, void (*f)(void *, unsigned int, unsigned int),
+		     unsigned int begin, unsigned int end, unsigned int grain)
+{
+	os_task_t *batch[64];
+	unsigned int n = 0;
+
+	if (grain == 0)
+		grain = 1;
+
+	while (begin < end) {
+		unsigned int stop = end - begin > grain ? begin + grain : end;
+
+		batch[n++] = range_task_create(arg, f, begin, stop);
+		begin = stop;
+		if (n == sizeof(batch) / sizeof(batch[0])) {
+			add_tasks_in_queue(tp, batch, n);
+			n = 0;
+		}
 	}
-	os_task_queue_t *task = tp->tasks;
+	add_tasks_in_queue(tp, batch, n);
+}
+
+/* Get the most recent task submitted from outside the pool */
+static os_task_t *get_external_task(os_threadpool_t *tp)
+{
+	// Unlocked peek, the queue is re-checked under the lock
+	if (atomic_load_explicit(&tp->nTasks, memory_order_relaxed) == 0)
+		return NULL;
 
-	tp->tasks = task->next;
+	os_task_t *t = NULL;
+
+	pthread_mutex_lock(&tp->taskLock);
+
+	size_t count = atomic_load_explicit(&tp->nTasks, memory_order_relaxed);
+
+	if (count > 0) {
+		t = tp->tasks[count - 1];
+		atomic_store_explicit(&tp->nTasks, count - 1, memory_order_relaxed);
+	}
 	pthread_mutex_unlock(&tp->taskLock);
+	return t;
+}
 
-	os_task_t *t = task->task;
+static inline unsigned int xorshift32(unsigned int *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
 
-	free(task);
+/*
+ * Steal a task from randomly chosen workers other than the caller. Workers
+ * on the caller's NUMA node are tried first: their tasks were mostly added
+ * while working on memory local to that node.
+ */
+static os_task_t *steal_task(os_threadpool_t *tp)
+{
+	// Peers and ids are only meaningful within the caller's own pool
+	os_worker_t *w = pool_worker(tp);
+	unsigned int seed = w != NULL ? w->seed : (unsigned int) (long) &seed;
+	unsigned int i, victim;
+	os_task_t *t = NULL;
+
+	if (w != NULL && w->nPeers > 0) {
+		unsigned int start = xorshift32(&seed);
+
+		for (i = 0; i < w->nPeers && t == NULL; ++i) {
+			victim = w->peers[(start + i) % w->nPeers];
+			t = deque_steal(&tp->workers[victim].deque);
+		}
+	}
+
+	for (i = 0; i < 2 * tp->num_threads && t == NULL; ++i) {
+		victim = xorshift32(&seed) % tp->num_threads;
+		if (w != NULL && victim == w->id)
+			continue;
+		t = deque_steal(&tp->workers[victim].deque);
+	}
+
+	if (w != NULL)
+		w->seed = seed;
+	return t;
+}
+
+/* Get a task: own deque first (LIFO), then external queue, then steal (FIFO) */
+os_task_t *get_task(os_threadpool_t *tp)
+{
+	os_task_t *t = NULL;
+
+	os_worker_t *w = pool_worker(tp);
+
+	if (w != NULL)
+		t = deque_pop(&w->deque);
+	if (t == NULL) {
+		t = get_external_task(tp);
+		if (t != NULL && w != NULL)
+			w->stats.external++;
+	}
+	if (t == NULL) {
+		t = steal_task(tp);
+		if (t != NULL && w != NULL)
+			w->stats.steals++;
+	}
+	if (t != NULL)
+		atomic_fetch_sub(&tp->queued, 1);
 	return t;
 }
 
 /* === THREAD POOL === */
 
+/* NUMA node of a CPU, from sysfs; 0 if the system does not report one */
+static int cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *entry;
+	DIR *dir;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	while ((entry = readdir(dir)) != NULL)
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node;
+}
+
+/* Assign the workers to the CPUs the process may run on, round-robin */
+static void place_workers(os_threadpool_t *pool)
+{
+	cpu_set_t allowed;
+	int cpus[CPU_SETSIZE];
+	unsigned int nCpus = 0, i, j;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return;
+	for (i = 0; i < CPU_SETSIZE; ++i)
+		if (CPU_ISSET(i, &allowed))
+			cpus[nCpus++] = i;
+	if (nCpus == 0)
+		return;
+
+	for (i = 0; i < pool->num_threads; ++i) {
+		pool->workers[i].cpu = cpus[i % nCpus];
+		pool->workers[i].node = cpu_node(pool->workers[i].cpu);
+	}
+
+	// Same-node victims for NUMA-local stealing
+	for (i = 0; i < pool->num_threads; ++i) {
+		os_worker_t *w = &pool->workers[i];
+
+		w->peers = malloc(pool->num_threads * sizeof(unsigned int));
+		if (w->peers == NULL) {
+			puts("Error allocating threadpool");
+			exit(-1);
+		}
+		for (j = 0; j < pool->num_threads; ++j)
+			if (j != i && pool->workers[j].node == w->node)
+				w->peers[w->nPeers++] = j;
+	}
+}
+
 /* Initialize the new threadpool */
 os_threadpool_t *threadpool_create(unsigned int _, unsigned int nThreads)
+{
+	return threadpool_create_attr(nThreads, NULL);
+}
+
+/* Initialize a new threadpool with optional worker placement and setup */
+os_threadpool_t *threadpool_create_attr(unsigned int nThreads, const os_threadpool_attr_t *attr)
 {
 	os_threadpool_t *pool = calloc(1, sizeof(os_threadpool_t));
 
 	pool->num_threads = nThreads;
+	if (attr != NULL)
+		pool->attr = *attr;
+	pool->instrument = pool->attr.statsFile != NULL || pool->attr.traceFile != NULL;
+	pool->startNs = now_ns();
 	pthread_mutex_init(&pool->taskLock, NULL);
+	pthread_mutex_init(&pool->waitLock, NULL);
+	pthread_cond_init(&pool->taskCond, NULL);
+	pthread_cond_init(&pool->doneCond, NULL);
 
 	pool->threads = malloc(sizeof(pthread_t) * nThreads);
+	pool->workers = aligned_alloc(OS_CACHE_LINE, sizeof(os_worker_t) * nThreads);
+	if (pool->threads == NULL || pool->workers == NULL) {
+		puts("Error allocating threadpool");
+		exit(-1);
+	}
+	memset(pool->workers, 0, sizeof(os_worker_t) * nThreads);
+
 	int i, r;
 
 	for (i = 0; i < nThreads; ++i) {
-		r = pthread_create(&pool->threads[i], NULL, thread_loop_function, pool);
+		pool->workers[i].id = i;
+		pool->workers[i].seed = 2654435761u * (i + 1);
+		pool->workers[i].pool = pool;
+		pool->workers[i].cpu = -1;
+		pool->workers[i].node = -1;
+	}
+	if (pool->attr.pinWorkers)
+		place_workers(pool);
+
+	// Workers set up their deques, then wait for each other, so that all
+	// deques exist before any worker may try to steal
+	pool->starting = nThreads;
+
+	for (i = 0; i < nThreads; ++i) {
+		pthread_attr_t threadAttr;
+		cpu_set_t cpu;
+
+		pthread_attr_init(&threadAttr);
+		if (pool->workers[i].cpu >= 0) {
+			CPU_ZERO(&cpu);
+			CPU_SET(pool->workers[i].cpu, &cpu);
+			pthread_attr_setaffinity_np(&threadAttr, sizeof(cpu), &cpu);
+		}
+		r = pthread_create(&pool->threads[i], &threadAttr, thread_loop_function, &pool->workers[i]);
+		pthread_attr_destroy(&threadAttr);
 		if (r) {
 			puts("Error creating pthread");
 			exit(-1);
 		}
 	}
 
+	pthread_mutex_lock(&pool->waitLock);
+	while (pool->starting > 0)
+		pthread_cond_wait(&pool->doneCond, &pool->waitLock);
+	pthread_mutex_unlock(&pool->waitLock);
+
 	return pool;
 }
 
-// One millisecond
-static struct timespec milli = {0, 1000000L};
+/* Block until a task is queued or the pool is stopped */
+static void wait_for_task(os_threadpool_t *tp)
+{
+	if (self != NULL)
+		self->stats.sleeps++;
+
+	pthread_mutex_lock(&tp->waitLock);
+	// Announce ourselves before re-checking, so that a concurrent
+	// add_task_in_queue() either sees us sleeping or we see its task
+	atomic_fetch_add(&tp->sleeping, 1);
+	while (!atomic_load(&tp->should_stop) && atomic_load(&tp->queued) <= 0)
+		pthread_cond_wait(&tp->taskCond, &tp->waitLock);
+	atomic_fetch_sub(&tp->sleeping, 1);
+	pthread_mutex_unlock(&tp->waitLock);
+}
+
+/* Mark a task as finished and wake up waiters once none are left */
+static void task_done(os_threadpool_t *tp)
+{
+	if (atomic_fetch_sub(&tp->pending, 1) != 1)
+		return;
+
+	pthread_mutex_lock(&tp->waitLock);
+	pthread_cond_broadcast(&tp->doneCond);
+	pthread_mutex_unlock(&tp->waitLock);
+}
+
+static void run_future_task(void *arg);
+static void run_for_task(void *arg);
+static void *task_func(os_task_t *task);
+
+/* Account a task run by a worker, and add it to the worker's trace */
+static void record_task(os_threadpool_t *tp, os_worker_t *w, void *func,
+			unsigned long long begin, unsigned long long end)
+{
+	// Nested tasks run inside the time of the task that waits for them
+	if (w->nesting == 0)
+		w->stats.busyNs += end - begin;
+	if (tp->attr.traceFile == NULL)
+		return;
+
+	if (w->traceLen == w->traceCap) {
+		size_t cap = w->traceCap ? 2 * w->traceCap : 1024;
+		os_trace_event_t *trace;
+
+		if (cap > TRACE_MAX_EVENTS ||
+		    (trace = realloc(w->trace, cap * sizeof(os_trace_event_t))) == NULL) {
+			w->traceDropped++;
+			return;
+		}
+		w->trace = trace;
+		w->traceCap = cap;
+	}
+	w->trace[w->traceLen++] = (os_trace_event_t) {
+		.begin = begin - tp->startNs,
+		.end = end - tp->startNs,
+		.func = func,
+	};
+}
+
+/* Run a task taken from the pool and free it */
+static void run_task(os_threadpool_t *tp, os_task_t *task)
+{
+	os_worker_t *w = pool_worker(tp);
+
+	if (w == NULL || !tp->instrument) {
+		if (w != NULL)
+			w->stats.tasks++;
+		task->task(task->argument);
+		free(task);
+		task_done(tp);
+		return;
+	}
+
+	void *func = task_func(task);
+	unsigned long long begin = now_ns();
+
+	w->stats.tasks++;
+	w->nesting++;
+	task->task(task->argument);
+	free(task);
+	w->nesting--;
+	record_task(tp, w, func, begin, now_ns());
+	task_done(tp);
+}
 
 /* Loop function for threads */
 void *thread_loop_function(void *args)
 {
-	os_threadpool_t *tp = args;
+	os_threadpool_t *tp;
 
-	while (!tp->should_stop) {
+	self = args;
+	tp = self->pool;
+
+	// Allocated here, so that the deque is local to the worker's CPU
+	if (deque_init(&self->deque, OS_DEQUE_INITIAL_SIZE) < 0) {
+		puts("Error allocating worker deque");
+		exit(-1);
+	}
+	if (tp->attr.workerInit != NULL)
+		tp->attr.workerInit(tp->attr.initArg, self->id);
+	if (tp->instrument)
+		self->stats.runNs = now_ns();
+	pthread_mutex_lock(&tp->waitLock);
+	if (--tp->starting == 0)
+		pthread_cond_broadcast(&tp->doneCond);
+	while (tp->starting > 0)
+		pthread_cond_wait(&tp->doneCond, &tp->waitLock);
+	pthread_mutex_unlock(&tp->waitLock);
+
+	while (!atomic_load(&tp->should_stop)) {
 		// Try to grab a new task
 		os_task_t *task = get_task(tp);
 
-		// If there is no task, wait 10 millis before trying to grab task again
+		// If there is no task, sleep until one is added
 		if (task == NULL)
-			nanosleep(&milli, NULL);
-		else {
-			// Run task
-			task->task(task->argument);
-			free(task);
-		}
+			wait_for_task(tp);
+		else
+			run_task(tp, task);
 	}
+	if (tp->instrument)
+		self->stats.runNs = now_ns() - self->stats.runNs;
 	return NULL;
 }
 
+/* Index of the calling worker in the pool, -1 if not one of its workers */
+int threadpool_worker_id(os_threadpool_t *tp)
+{
+	if (self == NULL || self->pool != tp)
+		return -1;
+	return self->id;
+}
+
+/* Number of tasks added and not yet finished */
+unsigned int threadpool_pending(os_threadpool_t *tp)
+{
+	return atomic_load(&tp->pending);
+}
+
+/*
+ * Wait until every added task has finished, including the tasks added by
+ * running tasks. Must not be called from one of the pool's workers.
+ */
+void threadpool_wait(os_threadpool_t *tp)
+{
+	pthread_mutex_lock(&tp->waitLock);
+	while (atomic_load(&tp->pending) != 0)
+		pthread_cond_wait(&tp->doneCond, &tp->waitLock);
+	pthread_mutex_unlock(&tp->waitLock);
+}
+
+/* === INSTRUMENTATION === */
+
+/* Print the workers' counters as a table, with a total line */
+static void print_stats(os_threadpool_t *tp, FILE *f)
+{
+	os_worker_stats_t total = { 0 };
+	unsigned int i;
+
+	fprintf(f, "%6s %4s %10s %10s %10s %8s %10s %10s %6s %9s\n", "worker", "cpu", "tasks",
+		"steals", "external", "sleeps", "busy ms", "idle ms", "util", "max deque");
+	for (i = 0; i <= tp->num_threads; ++i) {
+		os_worker_stats_t *st = i < tp->num_threads ? &tp->workers[i].stats : &total;
+		unsigned long long idleNs = st->runNs > st->busyNs ? st->runNs - st->busyNs : 0;
+
+		if (i < tp->num_threads) {
+			fprintf(f, "%6u %4d", i, tp->workers[i].cpu);
+			total.tasks += st->tasks;
+			total.steals += st->steals;
+			total.external += st->external;
+			total.sleeps += st->sleeps;
+			total.busyNs += st->busyNs;
+			total.runNs += st->runNs;
+			if (st->maxDepth > total.maxDepth)
+				total.maxDepth = st->maxDepth;
+		} else {
+			fprintf(f, "%6s %4s", "total", "");
+		}
+		fprintf(f, " %10llu %10llu %10llu %8llu %10.3f %10.3f %5.1f%% %9ld\n", st->tasks,
+			st->steals, st->external, st->sleeps, st->busyNs / 1e6, idleNs / 1e6,
+			st->runNs ? 100.0 * st->busyNs / st->runNs : 0.0, st->maxDepth);
+	}
+}
+
+/*
+ * Name of a task function: its symbol if exported, else its offset in the
+ * binary, which "addr2line -f -e <binary> <offset>" maps back to the source.
+ */
+static void func_name(void *func, char *buf, size_t len)
+{
+	Dl_info info;
+
+	if (dladdr(func, &info) == 0 || info.dli_fname == NULL)
+		snprintf(buf, len, "%p", func);
+	else if (info.dli_sname != NULL)
+		snprintf(buf, len, "%s", info.dli_sname);
+	else
+		snprintf(buf, len, "%s+%#lx", basename((char *) info.dli_fname),
+			 (unsigned long) ((char *) func - (char *) info.dli_fbase));
+}
+
+/*
+ * Write the tasks run by every worker in the Chrome trace event format, which
+ * chrome://tracing and ui.perfetto.dev open.
+ */
+static void write_trace(os_threadpool_t *tp, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	void *lastFunc = NULL;
+	char name[256] = "";
+	unsigned int i;
+	size_t j;
+
+	if (f == NULL) {
+		perror(path);
+		return;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < tp->num_threads; ++i) {
+		os_worker_t *w = &tp->workers[i];
+
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"name\":\"worker %u\"}}", i ? ",\n" : "", i, i);
+		for (j = 0; j < w->traceLen; ++j) {
+			if (w->trace[j].func != lastFunc) {
+				lastFunc = w->trace[j].func;
+				func_name(lastFunc, name, sizeof(name));
+			}
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":0,"
+				"\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", name, i,
+				w->trace[j].begin / 1e3, (w->trace[j].end - w->trace[j].begin) / 1e3);
+		}
+		if (w->traceDropped > 0)
+			fprintf(stderr, "[trace] worker %u: %llu events dropped\n", i, w->traceDropped);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
 /* Stop the thread pool once a condition is met */
 void threadpool_stop(os_threadpool_t *tp, int (*processingIsDone)(os_threadpool_t *))
 {
-	// Wait for processing to complete
+	// Wait for processing to complete; the condition is only checked
+	// when no task is left, and it may add new tasks
 	if (processingIsDone != NULL) {
-		while (!processingIsDone(tp))
-			nanosleep(&milli, NULL);
+		do {
+			threadpool_wait(tp);
+		} while (!processingIsDone(tp));
 	}
 	// Call for stop and wait for all threads to finish
-	tp->should_stop = 1;
+	pthread_mutex_lock(&tp->waitLock);
+	atomic_store(&tp->should_stop, 1);
+	pthread_cond_broadcast(&tp->taskCond);
+	pthread_mutex_unlock(&tp->waitLock);
+
 	int i, r;
 
 	for (i = 0; i < tp->num_threads; ++i) {
@@ -117,8 +644,251 @@ void threadpool_stop(os_threadpool_t *tp, int (*processingIsDone)(os_threadpool_
 			exit(-1);
 		}
 	}
+	if (tp->attr.statsFile != NULL)
+		print_stats(tp, tp->attr.statsFile);
+	if (tp->attr.traceFile != NULL)
+		write_trace(tp, tp->attr.traceFile);
+
 	// Free threadpool
+	for (i = 0; i < tp->num_threads; ++i) {
+		deque_destroy(&tp->workers[i].deque);
+		free(tp->workers[i].peers);
+		free(tp->workers[i].trace);
+	}
+	free(tp->workers);
 	free(tp->threads);
+	free(tp->tasks);
 	pthread_mutex_destroy(&tp->taskLock);
+	pthread_mutex_destroy(&tp->waitLock);
+	pthread_cond_destroy(&tp->taskCond);
+	pthread_cond_destroy(&tp->doneCond);
 	free(tp);
 }
+
+/* === FUTURES AND PARALLEL LOOPS === */
+
+#define TP_CHUNKS_PER_THREAD 4
+
+typedef struct {
+	os_task_t task;			// Must stay first, the task is freed through it
+	os_future_t *future;
+	void (*func)(void *);
+	void *argument;
+} future_task_t;
+
+typedef struct {
+	os_task_t task;			// Must stay first, the task is freed through it
+	os_future_t *future;
+	void (*func)(void *, size_t, size_t);
+	void *ctx;
+	size_t begin, end;
+} for_task_t;
+
+static void future_init(os_future_t *future, unsigned int count)
+{
+	atomic_init(&future->remaining, count);
+	pthread_mutex_init(&future->lock, NULL);
+	pthread_cond_init(&future->cond, NULL);
+}
+
+static void future_destroy(os_future_t *future)
+{
+	pthread_mutex_destroy(&future->lock);
+	pthread_cond_destroy(&future->cond);
+}
+
+/*
+ * The last task completes the future under its lock, and waiters take the
+ * lock before returning: once a waiter sees it done, no task still uses the
+ * future, which the waiter can destroy.
+ */
+static void future_complete(os_future_t *future)
+{
+	unsigned int left = atomic_load(&future->remaining);
+
+	while (left > 1)
+		if (atomic_compare_exchange_weak(&future->remaining, &left, left - 1))
+			return;
+
+	pthread_mutex_lock(&future->lock);
+	atomic_store(&future->remaining, 0);
+	pthread_cond_broadcast(&future->cond);
+	pthread_mutex_unlock(&future->lock);
+}
+
+/* Wait for the future's tasks, running other tasks if called from a worker */
+static void future_wait(os_threadpool_t *tp, os_future_t *future)
+{
+	if (self != NULL && self->pool == tp) {
+		while (atomic_load(&future->remaining) != 0) {
+			os_task_t *task = get_task(tp);
+
+			if (task != NULL)
+				run_task(tp, task);
+			else
+				sched_yield();
+		}
+	}
+
+	pthread_mutex_lock(&future->lock);
+	while (atomic_load(&future->remaining) != 0)
+		pthread_cond_wait(&future->cond, &future->lock);
+	pthread_mutex_unlock(&future->lock);
+}
+
+static void run_future_task(void *arg)
+{
+	future_task_t *ft = arg;
+
+	ft->func(ft->argument);
+	future_complete(ft->future);
+}
+
+/* Add a task running f(arg); the returned future must be passed to tp_wait() */
+os_future_t *tp_submit(os_threadpool_t *tp, void (*f)(void *), void *arg)
+{
+	os_future_t *future = malloc(sizeof(os_future_t));
+	future_task_t *ft = malloc(sizeof(future_task_t));
+
+	if (future == NULL || ft == NULL) {
+		puts("Error allocating task");
+		exit(-1);
+	}
+	future_init(future, 1);
+	ft->task.argument = ft;
+	ft->task.task = run_future_task;
+	ft->future = future;
+	ft->func = f;
+	ft->argument = arg;
+	add_task_in_queue(tp, &ft->task);
+	return future;
+}
+
+/* Wait for a task added with tp_submit() and free its future */
+void tp_wait(os_threadpool_t *tp, os_future_t *future)
+{
+	future_wait(tp, future);
+	future_destroy(future);
+	free(future);
+}
+
+static void run_for_task(void *arg)
+{
+	for_task_t *ft = arg;
+
+	ft->func(ft->ctx, ft->begin, ft->end);
+	future_complete(ft->future);
+}
+
+/* Split [begin, end) in grain-sized chunks and run fn on each of them */
+static void parallel_chunks(os_threadpool_t *tp, size_t begin, size_t end, size_t grain,
+			    void (*fn)(void *, size_t, size_t), void *ctx)
+{
+	os_future_t future;
+	os_task_t *batch[64];
+	size_t nChunks = (end - begin + grain - 1) / grain;
+	unsigned int n = 0;
+
+	future_init(&future, nChunks);
+	while (begin < end) {
+		for_task_t *ft = malloc(sizeof(for_task_t));
+
+		if (ft == NULL) {
+			puts("Error allocating task");
+			exit(-1);
+		}
+		ft->task.argument = ft;
+		ft->task.task = run_for_task;
+		ft->future = &future;
+		ft->func = fn;
+		ft->ctx = ctx;
+		ft->begin = begin;
+		ft->end = end - begin > grain ? begin + grain : end;
+		begin = ft->end;
+
+		batch[n++] = &ft->task;
+		if (n == sizeof(batch) / sizeof(batch[0])) {
+			add_tasks_in_queue(tp, batch, n);
+			n = 0;
+		}
+	}
+	add_tasks_in_queue(tp, batch, n);
+	future_wait(tp, &future);
+	future_destroy(&future);
+}
+
+static size_t default_grain(os_threadpool_t *tp, size_t n)
+{
+	size_t chunks = tp->num_threads * TP_CHUNKS_PER_THREAD;
+
+	return n > chunks ? (n + chunks - 1) / chunks : 1;
+}
+
+void tp_parallel_for(os_threadpool_t *tp, size_t begin, size_t end, size_t grain,
+		     void (*fn)(void *, size_t, size_t), void *ctx)
+{
+	if (begin >= end)
+		return;
+	if (grain == 0)
+		grain = default_grain(tp, end - begin);
+
+	// A single chunk runs in the caller
+	if (end - begin <= grain) {
+		fn(ctx, begin, end);
+		return;
+	}
+	parallel_chunks(tp, begin, end, grain, fn, ctx);
+}
+
+typedef struct {
+	long long (*map)(void *, size_t, size_t);
+	void *ctx;
+	size_t begin, grain;
+	long long *results;
+} reduce_ctx_t;
+
+static void reduce_chunk(void *arg, size_t begin, size_t end)
+{
+	reduce_ctx_t *r = arg;
+
+	r->results[(begin - r->begin) / r->grain] = r->map(r->ctx, begin, end);
+}
+
+long long tp_parallel_reduce(os_threadpool_t *tp, size_t begin, size_t end, size_t grain,
+			     long long identity, long long (*map)(void *, size_t, size_t),
+			     long long (*combine)(long long, long long), void *ctx)
+{
+	if (begin >= end)
+		return identity;
+	if (grain == 0)
+		grain = default_grain(tp, end - begin);
+
+	size_t nChunks = (end - begin + grain - 1) / grain, i;
+	reduce_ctx_t r = {
+		.map = map, .ctx = ctx, .begin = begin, .grain = grain,
+		.results = malloc(nChunks * sizeof(long long)),
+	};
+	long long result = identity;
+
+	if (r.results == NULL) {
+		puts("Error allocating reduction");
+		exit(-1);
+	}
+	tp_parallel_for(tp, begin, end, grain, reduce_chunk, &r);
+	for (i = 0; i < nChunks; ++i)
+		result = combine(result, r.results[i]);
+	free(r.results);
+	return result;
+}
+
+/* Function run by a task, looking through the pool's own task wrappers */
+static void *task_func(os_task_t *task)
+{
+	if (task->task == run_range_task)
+		return ((os_range_task_t *) task->argument)->func;
+	if (task->task == run_future_task)
+		return ((future_task_t *) task->argument)->func;
+	if (task->task == run_for_task)
+		return ((for_task_t *) task->argument)->func;
+	return task->task;
+}
@@ -1,34 +1,140 @@
 #ifndef __SO_THREADPOOL_H__
 #define __SO_THREADPOOL_H__
 
+#include <stdio.h>
 #include <pthread.h>
+#include "os_deque.h"
+
+#define OS_DEQUE_INITIAL_SIZE 256
 
 typedef struct {
     void *argument;
     void (*task)(void *);
 } os_task_t;
 
-typedef struct _node{
-    os_task_t *task;
-    struct _node *next;
-} os_task_queue_t;
+/* Task running f(arg, begin, end) on the [begin, end) slice of a range */
+typedef struct {
+    os_task_t task;             // Must stay first, the task is freed through it
+    void *argument;
+    void (*func)(void *, unsigned int, unsigned int);
+    unsigned int begin, end;
+} os_range_task_t;
+
+/* Completion of one or more tasks, waited for with tp_wait() */
+typedef struct {
+    atomic_uint remaining;      // Tasks not finished yet
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} os_future_t;
+
+struct os_threadpool_t;
+
+/* Counters of one worker; times are only measured when instrumentation is on */
+typedef struct {
+    unsigned long long tasks;       // Tasks run, including nested ones
+    unsigned long long steals;      // Tasks taken from other workers' deques
+    unsigned long long external;    // Tasks taken from the external queue
+    unsigned long long sleeps;      // Waits for new tasks
+    unsigned long long busyNs;      // Time spent in tasks
+    unsigned long long runNs;       // Time between start and stop
+    long maxDepth;                  // Largest own deque size seen after a push
+} os_worker_stats_t;
+
+/* A task run by a worker, in nanoseconds since the pool was created */
+typedef struct {
+    unsigned long long begin, end;
+    void *func;
+} os_trace_event_t;
 
+/* Per-worker state: the worker's own deque, stolen from by the others */
 typedef struct {
-    unsigned int should_stop;
+    os_deque_t deque;
+    unsigned int id;
+    unsigned int seed;          // Victim selection RNG state
+    struct os_threadpool_t *pool;
+
+    int cpu;                    // CPU the worker is pinned to, -1 if not pinned
+    int node;                   // NUMA node of that CPU, -1 if not pinned
+    unsigned int *peers;        // Other workers on the same node, stolen from first
+    unsigned int nPeers;
+
+    os_worker_stats_t stats;
+    unsigned int nesting;       // Tasks being run, > 1 while helping in tp_wait()
+    os_trace_event_t *trace;
+    size_t traceLen, traceCap;
+    unsigned long long traceDropped;
+} os_worker_t;
+
+/* Optional settings for threadpool_create_attr() */
+typedef struct {
+    int pinWorkers;             // Pin worker i to the i-th CPU the process may run on
+    // Run by every worker on its own thread, before threadpool_create_attr()
+    // returns; memory first written here is placed on the worker's NUMA node
+    void (*workerInit)(void *arg, unsigned int id);
+    void *initArg;
+    FILE *statsFile;            // Per-worker counters are printed here on stop
+    const char *traceFile;      // Chrome trace JSON of the tasks is written here on stop
+} os_threadpool_attr_t;
+
+typedef struct os_threadpool_t {
+    atomic_uint should_stop;
 
     unsigned int num_threads;
     pthread_t *threads;
+    os_worker_t *workers;
 
-    os_task_queue_t *tasks;
+    // Tasks submitted from outside the pool, as a stack
+    os_task_t **tasks;
+    size_t tasksCap;
+    atomic_size_t nTasks;
     pthread_mutex_t taskLock;
+
+    atomic_uint pending;        // Tasks added and not yet finished
+    atomic_int queued;          // Tasks added and not yet taken by a worker
+    atomic_uint sleeping;       // Workers blocked on taskCond
+    pthread_mutex_t waitLock;
+    pthread_cond_t taskCond;    // Signaled on new tasks and on stop
+    pthread_cond_t doneCond;    // Signaled when pending drops to zero
+
+    os_threadpool_attr_t attr;
+    unsigned int starting;      // Workers not yet initialized, under waitLock
+
+    int instrument;             // Measure times, for statsFile or traceFile
+    unsigned long long startNs;
 } os_threadpool_t;
 
 os_task_t *task_create(void *arg, void (*f)(void *));
+os_task_t *range_task_create(void *arg, void (*f)(void *, unsigned int, unsigned int),
+        unsigned int begin, unsigned int end);
 void add_task_in_queue(os_threadpool_t *tp, os_task_t *t);
+void add_tasks_in_queue(os_threadpool_t *tp, os_task_t **tasks, unsigned int n);
+void add_range_tasks(os_threadpool_t *tp, void *arg, void (*f)(void *, unsigned int, unsigned int),
+        unsigned int begin, unsigned int end, unsigned int grain);
 os_task_t *get_task(os_threadpool_t *tp);
 os_threadpool_t *_os_threadpool_create();
 os_threadpool_t *threadpool_create(unsigned int nTasks, unsigned int nThreads);
+os_threadpool_t *threadpool_create_attr(unsigned int nThreads, const os_threadpool_attr_t *attr);
 void *thread_loop_function(void *args);
+int threadpool_worker_id(os_threadpool_t *tp);
+unsigned int threadpool_pending(os_threadpool_t *tp);
+void threadpool_wait(os_threadpool_t *tp);
 void threadpool_stop(os_threadpool_t *tp, int (*processingIsDone)(os_threadpool_t *));
 
+/*
+ * Waitable tasks and data-parallel loops. Waiting from a worker runs other
+ * tasks of the pool meanwhile, so these may be nested inside tasks.
+ *
+ * tp_parallel_for() calls fn(ctx, b, e) on the chunks [begin + k * grain, ...)
+ * of [begin, end) and returns when all are done. A grain of 0 picks one that
+ * gives a few chunks per worker. tp_parallel_reduce() combines the results of
+ * map on every chunk, in chunk order.
+ */
+os_future_t *tp_submit(os_threadpool_t *tp, void (*f)(void *), void *arg);
+void tp_wait(os_threadpool_t *tp, os_future_t *future);
+void tp_parallel_for(os_threadpool_t *tp, size_t begin, size_t end, size_t grain,
+        void (*fn)(void *, size_t, size_t), void *ctx);
+long long tp_parallel_reduce(os_threadpool_t *tp, size_t begin, size_t end, size_t grain,
+        long long identity, long long (*map)(void *, size_t, size_t),
+        long long (*combine)(long long, long long), void *ctx);
+
 #endif
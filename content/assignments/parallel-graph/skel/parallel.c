@@ -2,112 +2,294 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
 #include "os_graph.h"
+#include "os_bfs.h"
+#include "os_cc.h"
+#include "os_bitmap.h"
 #include "os_threadpool.h"
 
 #define MAX_TASK 100
 #define MAX_THREAD 4
+#define SEED_CHUNKS_PER_THREAD 4
+#define NODE_BATCH 32		// Nodes processed by one task
+#define TASK_BATCH 16		// Tasks submitted at once
 
-pthread_mutex_t sumLock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t *visLocks;
+// Per-worker sums, each on its own cache line
+typedef struct {
+	_Alignas(OS_CACHE_LINE) long long sum;
+} partial_sum_t;
 
 os_threadpool_t *tp;
 
 os_graph_t *graph;
-volatile int sum;
+atomic_ulong *visited;		// One bit per node
+partial_sum_t *partialSums;	// One per worker, plus one for other threads
+int sum;
 
-// Function to add a task to threadpool, trying again if tasklist is full
-void processNode(void *nodeIdxVoid);
+// Nodes claimed by a task and handed over to a new task, as a range of nodes
+typedef struct {
+	unsigned int nodes[NODE_BATCH];
+} node_batch_t;
 
-void add_node_task(unsigned int nodeIdx)
+// Collects the nodes claimed by a task into batches and submits them
+typedef struct {
+	node_batch_t *batch;
+	unsigned int batchLen;
+	os_task_t *tasks[TASK_BATCH];
+	unsigned int nTasks;
+	long long sum;
+} submitter_t;
+
+static partial_sum_t *my_partial_sum(void)
 {
-	os_task_t *task = task_create((void *) (long) nodeIdx, processNode);
+	int id = threadpool_worker_id(tp);
 
-	add_task_in_queue(tp, task);
+	return &partialSums[id < 0 ? tp->num_threads : id];
 }
 
-void processNode(void *nodeIdxVoid)
+void process_batch(void *batchVoid, unsigned int begin, unsigned int end);
+
+static void flush_tasks(submitter_t *sb)
 {
-	unsigned int nodeIdx = (unsigned int) (long) nodeIdxVoid;
-	os_node_t *node = graph->nodes[nodeIdx];
+	add_tasks_in_queue(tp, sb->tasks, sb->nTasks);
+	sb->nTasks = 0;
+}
 
-	pthread_mutex_lock(&sumLock);
-	sum += node->nodeInfo;
-	pthread_mutex_unlock(&sumLock);
+static void flush_batch(submitter_t *sb)
+{
+	if (sb->batchLen == 0)
+		return;
 
-	// Add neighbours to task queue
-	for (int i = 0; i < node->cNeighbours; i++) {
-		unsigned int n = node->neighbours[i];
+	sb->tasks[sb->nTasks++] = range_task_create(sb->batch, process_batch, 0, sb->batchLen);
+	sb->batch = NULL;
+	sb->batchLen = 0;
+	if (sb->nTasks == TASK_BATCH)
+		flush_tasks(sb);
+}
 
-		pthread_mutex_lock(&visLocks[n]);
-		if (graph->visited[n] == 0) {
-			graph->visited[n] = 1;
-			add_node_task(n);
-		}
-		pthread_mutex_unlock(&visLocks[n]);
+static void submit_node(submitter_t *sb, unsigned int nodeIdx)
+{
+	if (sb->batch == NULL)
+		sb->batch = malloc(sizeof(node_batch_t));
+	sb->batch->nodes[sb->batchLen++] = nodeIdx;
+	if (sb->batchLen == NODE_BATCH)
+		flush_batch(sb);
+}
+
+// Submit the remaining nodes and add the task's sum to the worker's sum
+static void submitter_finish(submitter_t *sb)
+{
+	flush_batch(sb);
+	flush_tasks(sb);
+	my_partial_sum()->sum += sb->sum;
+}
+
+void processNode(unsigned int nodeIdx, submitter_t *sb)
+{
+	os_node_t node = os_graph_node(graph, nodeIdx);
+
+	sb->sum += node.nodeInfo;
+
+	// Hand the neighbours over to new tasks
+	for (int i = 0; i < node.cNeighbours; i++) {
+		unsigned int n = node.neighbours[i];
+
+		if (bitmap_claim(visited, n))
+			submit_node(sb, n);
 	}
-	// Node process complete
-	pthread_mutex_lock(&visLocks[nodeIdx]);
-	graph->visited[nodeIdx] = 2;
-	pthread_mutex_unlock(&visLocks[nodeIdx]);
 }
 
-// Check if entire graph was processsed and re-start traversal when it stops
-int is_done(os_threadpool_t *_)
+void process_batch(void *batchVoid, unsigned int begin, unsigned int end)
 {
-	for (int i = 0; i < graph->nCount; ++i) {
-		if (graph->visited[i] != 2) {
-			// If the graph is not connected, the traversal won't reach all nodes from node 0
-			// If traversal ends (tasks becomes NULL), re-start the traversal from the first
-			// un-visited node by creating a new task for it
-			pthread_mutex_lock(&visLocks[i]);
-			if (graph->visited[i] == 0) {
-				graph->visited[i] = 1;
-				add_node_task(i);
-			}
-			pthread_mutex_unlock(&visLocks[i]);
-			return 0;
-		}
+	node_batch_t *batch = batchVoid;
+	submitter_t sb = { 0 };
+
+	for (unsigned int i = begin; i < end; ++i)
+		processNode(batch->nodes[i], &sb);
+	free(batch);
+	submitter_finish(&sb);
+}
+
+// Start a traversal from every node of a range that no traversal reached yet
+void seed_range(void *arg, unsigned int begin, unsigned int end)
+{
+	submitter_t sb = { 0 };
+
+	for (unsigned int i = begin; i < end; ++i)
+		if (bitmap_claim(visited, i))
+			processNode(i, &sb);
+	submitter_finish(&sb);
+}
+
+// Seed all components in parallel; each node is claimed only once
+void seed_components(void)
+{
+	unsigned int chunks = tp->num_threads * SEED_CHUNKS_PER_THREAD;
+
+	add_range_tasks(tp, NULL, seed_range, 0, graph->nCount, (graph->nCount + chunks - 1) / chunks);
+}
+
+// Graph being copied by the workers, each writing its own part first
+typedef struct {
+	os_graph_t *src, *dst;
+	unsigned int parts;
+} graph_placement_t;
+
+// Worker setup: copy the worker's slice of the nodes, placing it on its NUMA node
+void place_graph_part(void *arg, unsigned int id)
+{
+	graph_placement_t *p = arg;
+	unsigned int n = p->src->nCount;
+
+	os_graph_copy_part(p->dst, p->src, (unsigned long long) n * id / p->parts,
+			   (unsigned long long) n * (id + 1) / p->parts);
+}
+
+// Traverse the graph with one task per batch of nodes; returns the sum of the nodes
+long long task_traverse(void)
+{
+	long long total = 0;
+
+	visited = bitmap_create(graph->nCount);
+	partialSums = aligned_alloc(OS_CACHE_LINE, sizeof(partial_sum_t) * (tp->num_threads + 1));
+	if (visited == NULL || partialSums == NULL) {
+		printf("[Error] Not enough memory\n");
+		exit(-1);
 	}
-	return 1;
+	memset(partialSums, 0, sizeof(partial_sum_t) * (tp->num_threads + 1));
+
+	seed_components();
+	threadpool_wait(tp);
+
+	// Reduce the per-worker sums
+	for (unsigned int i = 0; i <= tp->num_threads; ++i)
+		total += partialSums[i].sum;
+
+	free(partialSums);
+	free(visited);
+	return total;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [-t num_threads] [-m task|bfs|cc] [-c] [-p] [-s] [-T trace.json] [-v] input_file\n", argv0);
+	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		printf("Usage: %s input_file\n", argv[0]);
-		exit(1);
+	unsigned int num_threads = MAX_THREAD;
+	enum { MODE_TASK, MODE_BFS, MODE_CC } mode = MODE_TASK;
+	FILE *components = NULL;
+	int pin = 0;
+	int verbose = 0;
+	int opt;
+	os_threadpool_attr_t attr = { 0 };
+	graph_placement_t placement = { 0 };
+
+	while ((opt = getopt(argc, argv, "t:m:cpsT:v")) != -1) {
+		switch (opt) {
+		case 't':
+			num_threads = atoi(optarg);
+			if (num_threads == 0)
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (strcmp(optarg, "bfs") == 0)
+				mode = MODE_BFS;
+			else if (strcmp(optarg, "task") == 0)
+				mode = MODE_TASK;
+			else if (strcmp(optarg, "cc") == 0)
+				mode = MODE_CC;
+			else
+				usage(argv[0]);
+			break;
+		case 'c':
+			components = stderr;
+			break;
+		case 'p':
+			pin = 1;
+			break;
+		case 's':
+			attr.statsFile = stderr;
+			break;
+		case 'T':
+			attr.traceFile = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
+	if (optind != argc - 1)
+		usage(argv[0]);
 
-	FILE *input_file = fopen(argv[1], "r");
+	FILE *input_file = fopen(argv[optind], "r");
 
 	if (input_file == NULL) {
 		printf("[Error] Can't open file\n");
 		return -1;
 	}
 
+	double start = now_ms();
+
 	graph = create_graph_from_file(input_file);
 	if (graph == NULL) {
 		printf("[Error] Can't read the graph from file\n");
 		return -1;
 	}
 
-	// Create vislocks for nodes
-	visLocks = malloc(sizeof(pthread_mutex_t) * graph->nCount);
-	for (int i = 0; i < graph->nCount; ++i)
-		pthread_mutex_init(&visLocks[i], NULL);
+	double loaded = now_ms();
+
+	if (pin) {
+		// Pin the workers and let each one copy its part of the graph
+		placement.src = graph;
+		placement.dst = os_graph_alloc_copy(graph);
+		placement.parts = num_threads;
+		if (placement.dst == NULL)
+			return -1;
+		attr.pinWorkers = 1;
+		attr.workerInit = place_graph_part;
+		attr.initArg = &placement;
+	}
+
+	tp = threadpool_create_attr(num_threads, &attr);
+	if (pin) {
+		destroy_graph(graph);
+		graph = placement.dst;
+	}
 
-	tp = threadpool_create(MAX_TASK, MAX_THREAD);
-	// is_done will add the first node to queue
-	threadpool_stop(tp, is_done);
+	double ready = now_ms();
 
-	// Destroy vislocks
-	for (int i = 0; i < graph->nCount; ++i)
-		pthread_mutex_destroy(&visLocks[i]);
-	free(visLocks);
+	switch (mode) {
+	case MODE_BFS:
+		sum = bfs_traverse(tp, graph);
+		break;
+	case MODE_CC:
+		sum = cc_traverse(tp, graph, components);
+		break;
+	default:
+		sum = task_traverse();
+	}
+	if (verbose)
+		fprintf(stderr, "load: %.3f ms\nsetup: %.3f ms\ntraverse: %.3f ms\n",
+			loaded - start, ready - loaded, now_ms() - ready);
+	threadpool_stop(tp, NULL);
 
 	printf("%d", sum);
 	return 0;
@@ -1,53 +1,107 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include "os_graph.h"
 
 int sum;
 os_graph_t *graph;
 
-void processNode(unsigned int nodeIdx)
+static double now_ms(void)
 {
-    os_node_t *node = graph->nodes[nodeIdx];
-    sum += node->nodeInfo;
-    for (int i = 0; i < node->cNeighbours; i++)
-        if (graph->visited[node->neighbours[i]] == 0) {
-            graph->visited[node->neighbours[i]] = 1;
-            processNode(node->neighbours[i]);
-        }
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Depth-first traversal from nodeIdx, with an explicit stack so that long
+// paths (e.g. in grid graphs) do not overflow the thread's stack
+void processNode(unsigned int nodeIdx, unsigned int *stack)
+{
+    size_t top = 0;
+
+    stack[top++] = nodeIdx;
+    while (top > 0) {
+        os_node_t node = os_graph_node(graph, stack[--top]);
+
+        sum += node.nodeInfo;
+        for (int i = 0; i < node.cNeighbours; i++)
+            if (graph->visited[node.neighbours[i]] == 0) {
+                graph->visited[node.neighbours[i]] = 1;
+                stack[top++] = node.neighbours[i];
+            }
+    }
 }
 
 void traverse_graph()
 {
+    // Every node is pushed at most once
+    unsigned int *stack;
+
+    if (graph->nCount == 0)
+        return;
+
+    stack = malloc(graph->nCount * sizeof(unsigned int));
+
+    if (stack == NULL) {
+        printf("[Error] Not enough memory\n");
+        exit(-1);
+    }
+
     for (int i = 0; i < graph->nCount; i++)
     {
         if (graph->visited[i] == 0) {
             graph->visited[i] = 1;
-            processNode(i);
+            processNode(i, stack);
         }
     }
+    free(stack);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
-        printf("Usage: %s input_file\n", argv[0]);
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt != 'v') {
+            printf("Usage: %s [-v] input_file\n", argv[0]);
+            exit(1);
+        }
+        verbose = 1;
+    }
+    if (optind != argc - 1) {
+        printf("Usage: %s [-v] input_file\n", argv[0]);
         exit(1);
     }
 
-    FILE *input_file = fopen(argv[1], "r");
+    FILE *input_file = fopen(argv[optind], "r");
 
     if (input_file == NULL) {
         printf("[Error] Can't open file\n");
         return -1;
     }
 
+    double start = now_ms();
+
     graph = create_graph_from_file(input_file);
     if (graph == NULL) {
         printf("[Error] Can't read the graph from file\n");
         return -1;
     }
 
+    graph->visited = calloc(graph->nCount, sizeof(unsigned int));
+    if (graph->visited == NULL && graph->nCount > 0) {
+        printf("[Error] Not enough memory\n");
+        return -1;
+    }
+
+    double loaded = now_ms();
+
     traverse_graph();
+    if (verbose)
+        fprintf(stderr, "load: %.3f ms\ntraverse: %.3f ms\n", loaded - start, now_ms() - loaded);
     printf("%d", sum);
     return 0;
 }